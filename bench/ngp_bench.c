@@ -0,0 +1,608 @@
+/* Copyright (C) 2013  Jonathan Klee, Guillaume Quéré
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* ngp is built in along with the bench so that its workers, matchers and
+ * result store are timed as they are, without the ui */
+#define main ngp_main
+#include "ngp.c"
+#undef main
+
+#include <sys/resource.h>
+
+#define BENCH_NEEDLE	"ngpneedle"
+#define BENCH_REGEX	"[a-z]+ [Nn]gp[Nn]eedle"
+#define BENCH_FILTER	"int"
+
+typedef struct s_corpus {
+	char			dir[PATH_MAX];
+	uint64_t		seed;
+	unsigned int		nbfiles;
+	unsigned int		depth;
+	unsigned int		fanout;
+	size_t			min_size;
+	size_t			max_size;
+
+	/* hits per 10000 lines, long lines per 1000 lines, binaries per
+	 * 1000 files: integers keep the corpus the same everywhere */
+	unsigned int		density;
+	unsigned int		long_lines;
+	unsigned int		binaries;
+
+	unsigned long long	bytes;
+} corpus_t;
+
+typedef struct s_result {
+	const char		*name;
+	double			seconds;
+	double			first_hit;
+	unsigned long long	files;
+	unsigned long long	bytes;
+	unsigned long long	entries;
+	unsigned long long	hits;
+} result_t;
+
+static const char *words[] = {
+	"int", "char", "return", "static", "struct", "void", "if", "else",
+	"for", "while", "size_t", "buffer", "length", "result", "pointer",
+	"const", "unsigned", "error", "value", "index", "node", "list",
+	"count", "offset", "flags", "mutex", "entry", "table", "data", "len"
+};
+
+static uint64_t		rng_state;
+static unsigned int	visited;
+
+/* xorshift64*, the same stream on every platform for a given seed */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static unsigned int rng_below(unsigned int n)
+{
+	return n ? rng() % n : 0;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static long peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+
+/*************************** CORPUS *******************************************/
+static void corpus_params(const corpus_t *corpus, char *buf, size_t size)
+{
+	snprintf(buf, size, "seed %llu files %u depth %u fanout %u "
+		"size %zu-%zu density %u long %u binaries %u\n",
+		(unsigned long long) corpus->seed, corpus->nbfiles,
+		corpus->depth, corpus->fanout, corpus->min_size,
+		corpus->max_size, corpus->density, corpus->long_lines,
+		corpus->binaries);
+}
+
+static void mkdirs(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			fprintf(stderr, "ngp_bench: cannot create %s\n", path);
+			exit(-1);
+		}
+		*p = '/';
+	}
+}
+
+/* sizes are spread evenly over powers of two between the bounds, as
+ * sources are: many small files and a few large ones */
+static size_t corpus_size(const corpus_t *corpus)
+{
+	unsigned int	shift, nbshifts = 0;
+	size_t		size;
+
+	while ((corpus->min_size << (nbshifts + 1)) <= corpus->max_size)
+		nbshifts++;
+	shift = rng_below(nbshifts + 1);
+	size = (corpus->min_size << shift) +
+		rng_below(corpus->min_size << shift);
+	return size > corpus->max_size ? corpus->max_size : size;
+}
+
+static size_t corpus_line(const corpus_t *corpus, char *buf, size_t size)
+{
+	const char	*word;
+	size_t		len = 0, target, wlen;
+	int		hit;
+
+	if (rng_below(1000) < corpus->long_lines)
+		target = 2000 + rng_below(6000);
+	else
+		target = 10 + rng_below(90);
+	if (target > size - 1)
+		target = size - 1;
+
+	/* half the hits are cased differently, for -i to find twice as
+	 * many */
+	hit = rng_below(10000) < corpus->density;
+	if (hit)
+		hit = 1 + rng_below(target / 8 + 1);
+	while (len < target) {
+		if (hit == 1)
+			word = rng_below(2) ? "NgpNeedle" : BENCH_NEEDLE;
+		else
+			word = words[rng_below(sizeof(words) / sizeof(*words))];
+		if (hit)
+			hit--;
+		wlen = strlen(word);
+		if (len + wlen + 1 > size - 1)
+			break;
+		memcpy(buf + len, word, wlen);
+		len += wlen;
+		buf[len++] = rng_below(8) ? ' ' : (rng_below(2) ? ';' : '(');
+	}
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static size_t corpus_file(const corpus_t *corpus, const char *path,
+		char *buf, size_t size, int binary)
+{
+	size_t	len = 0, i;
+	FILE	*f;
+
+	if (binary) {
+		for (i = 0; i < size; i++)
+			buf[i] = rng_below(4) ? rng() : '\0';
+		len = size;
+	} else {
+		while (len < size)
+			len += corpus_line(corpus, buf + len, size + 8192 - len);
+	}
+
+	if ((f = fopen(path, "w")) == NULL ||
+	    fwrite(buf, 1, len, f) != len || fclose(f)) {
+		fprintf(stderr, "ngp_bench: cannot write %s\n", path);
+		exit(-1);
+	}
+	return len;
+}
+
+/* the corpus is made again only when its parameters changed, they are kept
+ * aside it along with its size */
+static void corpus_make(corpus_t *corpus)
+{
+	char		path[PATH_MAX], stamp[PATH_MAX], params[256], line[256];
+	char		*buf;
+	unsigned int	i, d, depth;
+	size_t		size, len;
+	FILE		*f;
+
+	corpus_params(corpus, params, sizeof(params));
+	if (snprintf(stamp, sizeof(stamp), "%s.params", corpus->dir) >=
+	    (int) sizeof(stamp)) {
+		fprintf(stderr, "ngp_bench: %s is too long\n", corpus->dir);
+		exit(-1);
+	}
+	if ((f = fopen(stamp, "r")) != NULL) {
+		if (fgets(line, sizeof(line), f) && !strcmp(line, params) &&
+		    fscanf(f, "bytes %llu", &corpus->bytes) == 1) {
+			fclose(f);
+			return;
+		}
+		fclose(f);
+		fprintf(stderr, "ngp_bench: %s was made with other "
+			"parameters, remove it first\n", corpus->dir);
+		exit(-1);
+	}
+
+	rng_state = corpus->seed ? corpus->seed : 1;
+	buf = malloc(corpus->max_size + 8192);
+	corpus->bytes = 0;
+	for (i = 0; i < corpus->nbfiles; i++) {
+		len = snprintf(path, sizeof(path), "%s/", corpus->dir);
+		depth = rng_below(corpus->depth + 1);
+		for (d = 0; d < depth && len < sizeof(path); d++)
+			len += snprintf(path + len, sizeof(path) - len, "d%u/",
+				rng_below(corpus->fanout));
+		if (len >= sizeof(path) ||
+		    snprintf(path + len, sizeof(path) - len, "f%05u.c", i) >=
+		    (int) (sizeof(path) - len)) {
+			fprintf(stderr, "ngp_bench: %s is too long\n",
+				corpus->dir);
+			exit(-1);
+		}
+		mkdirs(path);
+
+		size = corpus_size(corpus);
+		corpus->bytes += corpus_file(corpus, path, buf, size,
+			rng_below(1000) < corpus->binaries);
+	}
+	free(buf);
+
+	if ((f = fopen(stamp, "w")) == NULL) {
+		fprintf(stderr, "ngp_bench: cannot write %s\n", stamp);
+		exit(-1);
+	}
+	fprintf(f, "%sbytes %llu\n", params, corpus->bytes);
+	fclose(f);
+}
+
+
+/*************************** BENCHES ******************************************/
+static void bench_visit(batch_t *batch, const work_t *work)
+{
+	S_VAR_NOT_USED(batch);
+	S_VAR_NOT_USED(work);
+	__atomic_add_fetch(&visited, 1, __ATOMIC_RELAXED);
+}
+
+static void bench_traverse(const corpus_t *corpus, result_t *result)
+{
+	struct timespec	start;
+	ignore_t	*ignore;
+
+	visited = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pool_init(bench_visit);
+	pool.prefix = strlen(corpus->dir) + 1;
+	ignore = ignore_global(corpus->dir);
+	pool_push(0, NULL, ignore, NULL, corpus->dir, 1);
+	ignore_release(ignore);
+	pool_run();
+	pool_free();
+	result->seconds = seconds_since(&start);
+	result->files = visited;
+}
+
+/* wait for search to be done, noting when its first entry came */
+static void bench_wait(search_t *search, const struct timespec *start,
+		result_t *result)
+{
+	pthread_mutex_t *mutex;
+
+	result->first_hit = -1;
+	synchronized(mainsearch.data_mutex) {
+		while (search->status) {
+			if (search->nbentry && result->first_hit < 0)
+				result->first_hit = seconds_since(start);
+			pthread_cond_wait(&search->grown,
+				&mainsearch.data_mutex);
+		}
+		if (search->nbentry && result->first_hit < 0)
+			result->first_hit = seconds_since(start);
+	}
+}
+
+/* the walk is made each time, the list of files of the last one would
+ * spare it otherwise */
+static void bench_search(const corpus_t *corpus, const char *pattern,
+		int icase, int is_regex, result_t *result)
+{
+	struct timespec	start;
+	unsigned int	i;
+
+	for (i = 0; i < mainsearch_attr.nbpatterns; i++)
+		free(mainsearch_attr.patterns[i]);
+	mainsearch_attr.nbpatterns = 0;
+	add_pattern(pattern);
+	strcpy(mainsearch.pattern, pattern);
+	strcpy(mainsearch.options, icase ? "-i" : "");
+	mainsearch.is_regex = is_regex;
+	matcher_free(&mainsearch.matcher);
+	if (matcher_init(&mainsearch.matcher, mainsearch_attr.patterns, 1,
+	    icase, is_regex) < 0) {
+		fprintf(stderr, "ngp_bench: bad pattern %s\n", pattern);
+		exit(-1);
+	}
+
+	filelist_free();
+	mainsearch_drop(0);
+	mainsearch.status = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (pthread_create(&pid, NULL, &lookup_thread, &mainsearch)) {
+		fprintf(stderr, "ngp_bench: cannot create thread\n");
+		exit(-1);
+	}
+	bench_wait(&mainsearch, &start, result);
+	pthread_join(pid, NULL);
+	result->seconds = seconds_since(&start);
+	result->files = filelist.nbpaths;
+	result->bytes = corpus->bytes;
+	result->hits = mainsearch.nb_lines;
+}
+
+/* filters the results of the last search, which are left in place */
+static void bench_subsearch(result_t *result)
+{
+	struct timespec	start;
+	search_t	*child;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	child = subsearch_start(&mainsearch, BENCH_FILTER, NULL);
+	bench_wait(child, &start, result);
+	subsearch_cancel(child);
+	result->seconds = seconds_since(&start);
+	result->entries = mainsearch.nbentry;
+	result->hits = child->nb_lines;
+	clean_search(child);
+	free(child);
+}
+
+/* the store only ever grows by blocks, whatever its size */
+static void bench_store(unsigned int nbentries, result_t *result)
+{
+	struct timespec	start;
+	entry_t		entry;
+	unsigned int	i;
+
+	mainsearch_drop(0);
+	memset(&entry, 0, sizeof(entry));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nbentries; i++) {
+		entry.isfile = (i & 15) == 0;
+		if (entry.isfile)
+			entry.file = i;
+		entry.line = i;
+		search_add_entry(&mainsearch, &entry);
+	}
+	result->seconds = seconds_since(&start);
+	result->entries = nbentries;
+	result->hits = mainsearch.nb_lines;
+	mainsearch_drop(0);
+}
+
+
+/*************************** REPORT *******************************************/
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_rate(const char *key, unsigned long long n, double seconds)
+{
+	if (n && seconds > 0)
+		printf(", \"%s\": %.1f", key, n / seconds);
+	else
+		printf(", \"%s\": null", key);
+}
+
+/* one json object per line, the median of the runs for times: lines are
+ * in the same order from a version to the other, for diff */
+static void report(const result_t *runs, unsigned int nbruns)
+{
+	double		seconds[nbruns], first[nbruns];
+	double		median, first_hit;
+	unsigned int	i;
+
+	for (i = 0; i < nbruns; i++) {
+		seconds[i] = runs[i].seconds;
+		first[i] = runs[i].first_hit;
+	}
+	qsort(seconds, nbruns, sizeof(double), cmp_double);
+	qsort(first, nbruns, sizeof(double), cmp_double);
+	median = seconds[nbruns / 2];
+	first_hit = first[nbruns / 2];
+
+	printf("{\"bench\": \"%s\", \"runs\": %u, \"seconds\": %.6f",
+		runs[0].name, nbruns, median);
+	printf(", \"files\": %llu, \"bytes\": %llu, \"entries\": %llu"
+		", \"hits\": %llu", runs[0].files, runs[0].bytes,
+		runs[0].entries, runs[0].hits);
+	print_rate("files_per_s", runs[0].files, median);
+	if (runs[0].bytes && median > 0)
+		printf(", \"mb_per_s\": %.1f", runs[0].bytes / median / 1e6);
+	else
+		printf(", \"mb_per_s\": null");
+	print_rate("entries_per_s", runs[0].entries, median);
+	if (first_hit >= 0)
+		printf(", \"first_hit_ms\": %.3f", first_hit * 1000);
+	else
+		printf(", \"first_hit_ms\": null");
+	printf(", \"peak_rss_kb\": %ld}\n", peak_rss_kb());
+	fflush(stdout);
+}
+
+
+/*************************** MAIN *********************************************/
+static void bench_usage(void)
+{
+	fprintf(stderr, "usage: ngp_bench [options] [bench...]\n\n"
+		"benches: traverse literal icase regex subsearch store, all "
+		"of them by default\n\n"
+		"options:\n"
+		"  --dir DIR       corpus, made there when missing "
+		"(ngp_bench_corpus)\n"
+		"  --seed N        seed of the corpus (1)\n"
+		"  --files N       number of files (2000)\n"
+		"  --depth N       deepest directory level (4)\n"
+		"  --fanout N      directories per level (6)\n"
+		"  --min-size N    smallest file, in bytes (256)\n"
+		"  --max-size N    largest file, in bytes (262144)\n"
+		"  --density N     hits per 10000 lines (20)\n"
+		"  --long-lines N  long lines per 1000 lines (5)\n"
+		"  --binaries N    binary files per 1000 files (20)\n"
+		"  --entries N     entries added by the store bench (4000000)\n"
+		"  --runs N        runs of each bench, the median is given (3)\n"
+		"  -j N            number of workers\n");
+	exit(-1);
+}
+
+static int is_wanted(char **benches, int nbbenches, const char *name)
+{
+	int i;
+
+	for (i = 0; i < nbbenches; i++) {
+		if (!strcmp(benches[i], name))
+			return 1;
+	}
+	return nbbenches == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	corpus_t	corpus;
+	result_t	*runs;
+	unsigned int	nbruns = 3, nbentries = 4000000, r;
+	int		opt;
+	size_t		len;
+
+	const struct option long_options[] = {
+		{ "dir",	required_argument, NULL, 'd' },
+		{ "seed",	required_argument, NULL, 's' },
+		{ "files",	required_argument, NULL, 'f' },
+		{ "depth",	required_argument, NULL, 'D' },
+		{ "fanout",	required_argument, NULL, 'F' },
+		{ "min-size",	required_argument, NULL, 'm' },
+		{ "max-size",	required_argument, NULL, 'M' },
+		{ "density",	required_argument, NULL, 'h' },
+		{ "long-lines",	required_argument, NULL, 'l' },
+		{ "binaries",	required_argument, NULL, 'b' },
+		{ "entries",	required_argument, NULL, 'e' },
+		{ "runs",	required_argument, NULL, 'r' },
+		{ NULL,		0,		   NULL, 0 }
+	};
+
+	memset(&corpus, 0, sizeof(corpus));
+	strcpy(corpus.dir, "ngp_bench_corpus");
+	corpus.seed = 1;
+	corpus.nbfiles = 2000;
+	corpus.depth = 4;
+	corpus.fanout = 6;
+	corpus.min_size = 256;
+	corpus.max_size = 1 << 18;
+	corpus.density = 20;
+	corpus.long_lines = 5;
+	corpus.binaries = 20;
+
+	while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			snprintf(corpus.dir, sizeof(corpus.dir), "%s", optarg);
+			break;
+		case 's':
+			corpus.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			corpus.nbfiles = atoi(optarg);
+			break;
+		case 'D':
+			corpus.depth = atoi(optarg);
+			break;
+		case 'F':
+			corpus.fanout = atoi(optarg);
+			break;
+		case 'm':
+			corpus.min_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'M':
+			corpus.max_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'h':
+			corpus.density = atoi(optarg);
+			break;
+		case 'l':
+			corpus.long_lines = atoi(optarg);
+			break;
+		case 'b':
+			corpus.binaries = atoi(optarg);
+			break;
+		case 'e':
+			nbentries = atoi(optarg);
+			break;
+		case 'r':
+			nbruns = atoi(optarg);
+			break;
+		case 'j':
+			mainsearch_attr.nbworkers = atoi(optarg);
+			break;
+		default:
+			bench_usage();
+		}
+	}
+	if (nbruns < 1 || corpus.fanout < 1 || corpus.min_size < 16 ||
+	    corpus.max_size < corpus.min_size)
+		bench_usage();
+
+	len = strlen(corpus.dir);
+	while (len > 1 && corpus.dir[len - 1] == '/')
+		corpus.dir[--len] = '\0';
+	corpus_make(&corpus);
+
+	current = &mainsearch;
+	init_searchstruct(&mainsearch);
+	pthread_mutex_init(&mainsearch.data_mutex, NULL);
+	pthread_mutex_init(&page_cache.mutex, NULL);
+	pthread_mutex_init(&filelist.mutex, NULL);
+	pthread_mutex_init(&output_mutex, NULL);
+	strcpy(mainsearch.directory, corpus.dir);
+	selector.max_size = -1;
+	mainsearch_attr.raw = 1;
+	mainsearch_attr.no_index = 1;
+
+	runs = calloc(nbruns, sizeof(result_t));
+	argv += optind;
+	argc -= optind;
+
+#define BENCH(bench_name, call) \
+	if (is_wanted(argv, argc, bench_name)) { \
+		for (r = 0; r < nbruns; r++) { \
+			memset(&runs[r], 0, sizeof(result_t)); \
+			runs[r].name = bench_name; \
+			runs[r].first_hit = -1; \
+			call; \
+		} \
+		report(runs, nbruns); \
+	}
+
+	BENCH("traverse", bench_traverse(&corpus, &runs[r]));
+	BENCH("literal", bench_search(&corpus, BENCH_NEEDLE, 0, 0, &runs[r]));
+	BENCH("icase", bench_search(&corpus, BENCH_NEEDLE, 1, 0, &runs[r]));
+	BENCH("regex", bench_search(&corpus, BENCH_REGEX, 0, 1, &runs[r]));
+
+	/* the filter runs over the hits of -i, whatever was asked before */
+	if (is_wanted(argv, argc, "subsearch"))
+		bench_search(&corpus, BENCH_NEEDLE, 1, 0, &runs[0]);
+	BENCH("subsearch", bench_subsearch(&runs[r]));
+	BENCH("store", bench_store(nbentries, &runs[r]));
+#undef BENCH
+
+	free(runs);
+	mainsearch_drop(0);
+	matcher_free(&mainsearch.matcher);
+	clean_all();
+	return 0;
+}
@@ -21,6 +21,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <stdio.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
@@ -34,6 +35,30 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <pthread.h>
 #include <ctype.h>
 #include <regex.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <time.h>
+#ifdef __linux__
+	#include <sys/inotify.h>
+#endif
+#ifdef HAVE_ZLIB
+	#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+	#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+	#include <zstd.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define NGP_SIMD_X86
+	#include <immintrin.h>
+#endif
 
 #define CURSOR_UP	'k'
 #define CURSOR_DOWN	'j'
@@ -41,53 +66,334 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define PAGE_DOWN	'J'
 #define ENTER		'p'
 #define QUIT		'q'
+#define NEW_SEARCH	'n'
+#define STATS_PANEL	's'
 
 #ifdef LINE_MAX
 	#undef LINE_MAX
 #endif
 #define LINE_MAX	256
 
+#define ARENA_CHUNK	(1 << 20)
+#define ENTRY_BLOCK	4096
+#define CACHE_PAGE	(1 << 16)
+#define CACHE_PAGES	64
+#define BINARY_PROBE	8192
+#define SUFFIX_LENS	16
+#define DIRENT_BUF	32768
+#define DIR_HANDLES	256
+#define FRAME_MS	33
+#define SPINNER_MS	100
+#define SUBSEARCH_CHUNK	1024
+#define DEBOUNCE_MS	50
+#define SCAN_BLOCK	(1 << 20)
+#define OUTPUT_BUF	(1 << 16)
+#define SPLIT_MIN	(64 << 20)
+#define SLICE_SIZE	(8 << 20)
+#define STREAM_BUF	(1 << 20)
+#define STREAM_BUFS	4
+#define STREAM_IN	(1 << 16)
+#define TAR_BLOCK	512
+
+#define FORMAT_PLAIN	0
+#define FORMAT_GZIP	1
+#define FORMAT_XZ	2
+#define FORMAT_ZSTD	3
+
+#define INDEX_NAME	".ngpindex"
+#define INDEX_MAGIC	"NGPIDX2"
+#define INDEX_SEGMENTS	8
+#define INDEX_BINARY	1
+#define INDEX_DIR	2
+#define INDEX_DELETED	4
+#define INDEX_SYMLINKS	1
+#define INDEX_NOIGNORE	2
+
+#define INDEX_BUILD	1
+#define INDEX_UPDATE	2
+#define INDEX_WATCH	3
+
+#define OUTPUT_PRINT	1
+#define OUTPUT_JSON	2
+#define OUTPUT_NULL	3
+
+#define OPT_INDEX	256
+#define OPT_NO_INDEX	257
+#define OPT_MIN_SIZE	258
+#define OPT_MAX_SIZE	259
+#define OPT_NEWER	260
+#define OPT_OLDER	261
+#define OPT_NO_IGNORE	262
+#define OPT_PRINT	263
+#define OPT_JSON	264
+#define OPT_NULL	265
+#define OPT_STATS	266
+
 #define S_VAR_NOT_USED(x) do{(void)(x);}while(0);
 
+/* with NGP_STATS, counters and timers of the search phases are kept and
+ * the time spent waiting on locks is measured; without it none of this
+ * is compiled in */
+#ifdef NGP_STATS
+#define STATS_BUCKETS	24
+#define STAT_ADD(field, n) \
+	__atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_START(t)	uint64_t t = now_ns()
+#define STAT_TIME(field, t)	STAT_ADD(field, now_ns() - (t))
+#define LOCK(mutex)	stats_lock(mutex)
+#else
+#define STAT_ADD(field, n)	do { } while (0)
+#define STAT_START(t)	do { } while (0)
+#define STAT_TIME(field, t)	do { } while (0)
+#define LOCK(mutex)	pthread_mutex_lock(mutex)
+#endif
+
 #define synchronized(MUTEX) \
 for(mutex = &MUTEX; \
-mutex && !pthread_mutex_lock(mutex); \
+mutex && !LOCK(mutex); \
 pthread_mutex_unlock(mutex), mutex = 0)
 
+/* a hit only refers to its line, the text is read back from the file when
+ * displayed: data is the path of file entries and stays NULL for lines,
+ * unless they come from something which can't be read twice */
 typedef struct s_entry_t {
 	char *data;
-	char isfile:1;
+	off_t offset;
+	unsigned int line;
+	unsigned int file;
+	unsigned short match;
+	unsigned short match_len;
+	unsigned int pattern:30;
+	unsigned int binary:1;
+	unsigned int isfile:1;
 } entry_t;
 
+/* bump allocator: strings are packed in big chunks which are only freed
+ * all together, with the search owning them */
+typedef struct s_chunk {
+	struct s_chunk	*next;
+	size_t		used;
+	size_t		size;
+	char		data[];
+} chunk_t;
+
+typedef struct s_arena {
+	chunk_t	*first;
+	chunk_t	*last;
+} arena_t;
+
 typedef struct s_exclude_list {
 	ino_t			d_ino;
 	struct s_exclude_list	*next;
 } exclude_list_t;
 
-typedef struct s_extension_list {
-	char			ext[LINE_MAX];
-	struct s_extension_list	*next;
-} extension_list_t;
-
-typedef struct s_specific_files {
-	char			spec[LINE_MAX];
-	struct s_specific_files	*next;
-} specific_files_t;
+/* set of strings, open addressing on their hash */
+typedef struct s_strset {
+	char		**slots;
+	uint32_t	size;
+	uint32_t	nb;
+} strset_t;
+
+typedef struct s_fileglob {
+	char		*pattern;
+	unsigned int	exclude:1;
+	unsigned int	path:1;
+} fileglob_t;
+
+/* which files are searched, compiled from the configuration and the
+ * options: names and suffixes are hashed, globs and predicates are only
+ * checked when some were given */
+typedef struct s_selector {
+	strset_t	names;
+	strset_t	suffixes;
+	size_t		lens[SUFFIX_LENS];
+	unsigned int	nblens;
+	fileglob_t	*globs;
+	unsigned int	nbglobs;
+	unsigned int	has_exclude_globs:1;
+	unsigned int	has_predicates:1;
+	unsigned int	all:1;
+	off_t		min_size;
+	off_t		max_size;
+	time_t		newer;
+	time_t		older;
+} selector_t;
+
+/* rule of an ignore file, anchored ones hold a '/' and are matched against
+ * the path from the directory of the ignore file, others against names */
+typedef struct s_ignore_rule {
+	char		*pattern;
+	unsigned int	negate:1;
+	unsigned int	dir_only:1;
+	unsigned int	anchored:1;
+} ignore_rule_t;
+
+/* rules of the ignore files of a directory, chained to the ones of its
+ * parents. Unless some rule is negated, which makes their order matter,
+ * plain names and "*suffix" rules are hashed and only the others are
+ * matched one by one */
+typedef struct s_ignore {
+	struct s_ignore	*parent;
+	char		*base;
+	int		refs;
+	unsigned int	ordered:1;
+	strset_t	names;
+	strset_t	dir_names;
+	strset_t	suffixes;
+	size_t		lens[SUFFIX_LENS];
+	unsigned int	nblens;
+	ignore_rule_t	*rules;
+	unsigned int	nbrules;
+} ignore_t;
+
+/* fixed string search, rare1 and rare2 are the offsets of the two bytes
+ * of the pattern least likely to show up in source code */
+typedef struct s_literal {
+	const char *	(*find)(const struct s_literal *, const char *, size_t);
+	const char	*pattern;
+	size_t		len;
+	unsigned int	icase:1;
+	size_t		rare1;
+	size_t		rare2;
+} literal_t;
+
+/* Aho-Corasick automaton looking for many fixed strings at once, bytes
+ * are mapped to classes so that the transition table stays small */
+typedef struct s_ac {
+	unsigned char	classes[256];
+	unsigned int	nbclasses;
+	unsigned int	nbstates;
+	int		*delta;
+	int		*out;
+	size_t		*lens;
+} ac_t;
+
+/* regex syntax tree, sets are bitmaps of the bytes a node matches */
+enum { RE_SET, RE_CAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST, RE_BOL, RE_EOL,
+	RE_EMPTY };
+
+typedef struct s_rnode {
+	int		type;
+	struct s_rnode	*left;
+	struct s_rnode	*right;
+	struct s_rnode	*chain;
+	unsigned char	set[32];
+} rnode_t;
+
+typedef struct s_rparser {
+	const char	*p;
+	unsigned int	icase:1;
+	int		error;
+	int		nbnodes;
+	rnode_t		*nodes;
+} rparser_t;
+
+/* literals every match of a syntax tree contains: exact is set when the
+ * tree matches a single string, req is the longest required substring */
+typedef struct s_rinfo {
+	char	*exact;
+	char	*prefix;
+	char	*suffix;
+	char	*req;
+} rinfo_t;
+
+/* Thompson automaton of the regexes */
+enum { NS_SET, NS_SPLIT, NS_BOL, NS_EOL, NS_MATCH };
+
+typedef struct s_nstate {
+	int		type;
+	int		out;
+	int		out1;
+	int		pattern;
+	unsigned char	set[32];
+} nstate_t;
+
+typedef struct s_nfa {
+	nstate_t	*states;
+	int		nbstates;
+	int		size;
+	int		start;
+	unsigned int	serial;
+} nfa_t;
+
+/* lazily built deterministic automaton, one per thread and nfa: a state is
+ * a set of nfa states, transitions are computed the first time they are
+ * taken and the whole cache is flushed when it grows too big */
+typedef struct s_dstate {
+	int	*set;
+	int	nbset;
+	int	match;
+	int	eol_match;
+} dstate_t;
+
+typedef struct s_dfa {
+	const nfa_t	*nfa;
+	unsigned int	serial;
+	dstate_t	*states;
+	unsigned char	*accept;
+	int		nbstates;
+	int		*trans;
+	int		*table;
+	int		*marks;
+	int		gen;
+	int		*stack;
+	int		*work;
+	int		*start_mid;
+	int		nbstart_mid;
+	int		start_bol;
+	struct s_dfa	*next;
+} dfa_t;
+
+/* finds the first match in a buffer, which needs not be nul terminated,
+ * and tells which of the patterns matched and how long the match is, a
+ * length of 0 meaning unknown */
+typedef struct s_matcher {
+	const char *	(*find)(const struct s_matcher *, const char *, size_t,
+				unsigned int *, size_t *);
+	char		**patterns;
+	unsigned int	nbpatterns;
+	regex_t		*regex;
+	literal_t	literal;
+	ac_t		ac;
+
+	/* regexes run by the dfa, lines are only handed to it once the
+	 * literals required by the regexes have been found */
+	nfa_t		*nfa;
+	unsigned int	prefilter;
+	char		**required;
+} matcher_t;
 
 typedef struct s_search_t {
 	/* screen */
 	int index;
 	int cursor;
 
-	/* data */
-	entry_t *entries;
+	/* data, entries are stored in blocks of ENTRY_BLOCK which never move;
+	 * subsearches only hold the indexes of their entries in mainsearch */
+	entry_t **blocks;
+	unsigned int nbblocks;
+	uint32_t *ids;
+	unsigned int size;
 	unsigned int nbentry;
+
+	/* progress of a subsearch through the entries of its father, after
+	 * the seed: ids kept by a broader filter it replaced */
+	uint32_t *seed;
+	unsigned int nbseed;
+	unsigned int seeded;
+	unsigned int scanned;
 	unsigned int nb_lines;
-	unsigned int size;
+	arena_t arena;
 
-	/* thread */
+	/* thread, entries of every search are guarded by mainsearch's
+	 * data_mutex; grown is signalled along with it when entries are added
+	 * or the search ends, for the subsearches following this one */
 	pthread_mutex_t data_mutex;
+	pthread_cond_t grown;
+	pthread_t thread;
 	unsigned int status:1;
+	unsigned int cancel:1;
+	unsigned int has_thread:1;
 
 	/* search */
 	char directory[PATH_MAX];
@@ -95,6 +401,7 @@ typedef struct s_search_t {
 	char options[LINE_MAX];
 	unsigned int is_regex:1;
 	regex_t *regex;
+	matcher_t matcher;
 
 	/* search in search */
 	struct s_search_t *father;
@@ -106,18 +413,1063 @@ typedef struct s_mainsearch_attr {
 	unsigned int raw:1;
 	unsigned int follow_symlinks:1;
 	unsigned int has_excludes:1;
+	unsigned int binary:1;
+	unsigned int index_action:2;
+	unsigned int no_index:1;
+	unsigned int no_ignore:1;
+	unsigned int restarted:1;
+	unsigned int output:2;
+	unsigned int decompress:1;
+	int nbworkers;
+
+	/* patterns given with -p and -P */
+	char			**patterns;
+	unsigned int		nbpatterns;
 
 	exclude_list_t		*firstexcl;
-	specific_files_t	*firstspec;
-	extension_list_t	*firstext;
 } mainsearch_attr_t;
 
+#ifdef NGP_STATS
+/* bumped by the workers with relaxed atomics, once per file or directory
+ * mostly; times are in nanoseconds, summed over the threads */
+typedef struct s_stats {
+	uint64_t	dirs;
+	uint64_t	files_visited;
+	uint64_t	files_skipped;
+	uint64_t	files_opened;
+	uint64_t	files_binary;
+	uint64_t	bytes_read;
+	uint64_t	lines_scanned;
+	uint64_t	matches;
+	uint64_t	walk_ns;
+	uint64_t	open_ns;
+	uint64_t	match_ns;
+	uint64_t	lock_waits;
+	uint64_t	lock_wait_ns;
+	uint64_t	frames;
+	uint64_t	render_ns;
+
+	/* files by the log2 of the microseconds they took */
+	uint64_t	latency[STATS_BUCKETS];
+} stats_t;
+#endif
+
+/* hits of the file being parsed, not yet visible to the display */
+typedef struct s_batch {
+	entry_t		*lines;
+	unsigned int	nblines;
+	unsigned int	size;
+	unsigned int	keep_text:1;
+	unsigned int	binary:1;
+	unsigned int	collect:1;
+	arena_t		arena;
+
+	/* without the ui, records of the hits are written out instead, path
+	 * being the one of the file parsed; unless collect is set, for hits
+	 * which only get their line number later on */
+	const char	*path;
+	char		*out;
+	size_t		outlen;
+	size_t		outsize;
+	unsigned int	outhits;
+
+	/* deque of the worker parsing */
+	int		worker;
+
+	/* lines before the buffer being scanned, when a file comes a part at
+	 * a time */
+	unsigned int	line_base;
+} batch_t;
+
+/* part of a big file, scanned by whichever worker claims it first; line
+ * numbers of its hits start over, nblines tells by how much to shift the
+ * ones of the next slices */
+typedef struct s_slice {
+	struct s_split	*split;
+	size_t		offset;
+	size_t		len;
+	unsigned int	nblines;
+	int		claimed;
+	batch_t		batch;
+} slice_t;
+
+/* big file being scanned by several workers, the one which split it waits
+ * for all the slices to put their hits back in order. Queued slices hold
+ * a reference, they may be popped long after the file is done */
+typedef struct s_split {
+	const char		*buf;
+	size_t			len;
+	const matcher_t		*matcher;
+	slice_t			*slices;
+	unsigned int		nbslices;
+	unsigned int		left;
+	int			refs;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		done;
+} split_t;
+
+/* decompressed data, handed by the thread inflating a file to the worker
+ * scanning it through a ring of buffers so that both run at once; filled
+ * and consumed count the buffers gone through each side */
+typedef struct s_stream {
+	int		fd;
+	int		format;
+	pthread_t	thread;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	char		*bufs[STREAM_BUFS];
+	size_t		lens[STREAM_BUFS];
+	unsigned int	filled;
+	unsigned int	consumed;
+	unsigned int	eof:1;
+	unsigned int	stop:1;
+
+	/* worker side: what is left of the buffer being read */
+	const char	*data;
+	size_t		avail;
+	unsigned int	holding:1;
+} stream_t;
+
+/* lines of a stream are scanned as they come, one cut by the end of a
+ * buffer waits in carry for the rest of it */
+typedef struct s_feed {
+	batch_t		*batch;
+	char		*carry;
+	size_t		carrylen;
+	size_t		carrysize;
+	unsigned int	lines;
+} feed_t;
+
+/* directory being browsed, kept open while its entries wait in the
+ * deques so that they can be opened relative to it */
+typedef struct s_dirhandle {
+	int		fd;
+	int		refs;
+} dirhandle_t;
+
+/* directory or file waiting to be browsed by a worker, name is the offset
+ * of its last component in path; or a slice of a big file */
+typedef struct s_work {
+	dirhandle_t	*parent;
+	ignore_t	*ignore;
+	slice_t		*slice;
+
+	/* entry in the index of a path only looked at if it changed since */
+	const struct s_index_file *indexed;
+
+	unsigned int	isdir:1;
+	unsigned int	name;
+	char		path[];
+} work_t;
+
+/* per-worker double-ended queue: the owner pushes and pops at tail,
+ * thieves steal at head */
+typedef struct s_deque {
+	pthread_mutex_t	mutex;
+	work_t		**items;
+	unsigned int	head;
+	unsigned int	tail;
+	unsigned int	size;
+} deque_t;
+
+typedef struct s_pool {
+	deque_t		*deques;
+	pthread_t	*threads;
+	int		nbworkers;
+
+	/* what is done with the files and directories found */
+	void		(*visit)(batch_t *, const work_t *);
+	void		(*visit_dir)(const work_t *, int);
+	int		nbhandles;
+
+	/* length of the searched directory and the '/' after it */
+	size_t		prefix;
+
+	/* items queued in deques, and items queued or being processed */
+	int		queued;
+	int		pending;
+
+	/* idle workers sleep here until work is pushed or the pool drains */
+	pthread_mutex_t	idle_mutex;
+	pthread_cond_t	idle_cond;
+	int		nbidle;
+
+	/* set when the search is replaced, workers drop what is left at the
+	 * next item or block of a file */
+	int		cancel;
+} pool_t;
+
+/* files the last complete walk went through: since neither the directory
+ * nor the selection can change, a new search parses them without walking
+ * again */
+typedef struct s_filelist {
+	pthread_mutex_t	mutex;
+	arena_t		arena;
+	char		**paths;
+	unsigned int	nbpaths;
+	unsigned int	size;
+	unsigned int	recording:1;
+	unsigned int	complete:1;
+} filelist_t;
+
+/* results of a former search, freed by a thread of their own */
+typedef struct s_garbage {
+	entry_t		**blocks;
+	unsigned int	nbblocks;
+	arena_t		arena;
+} garbage_t;
+
+/* a chunk of a file read back for display, pages are keyed by the index of
+ * the file entry in mainsearch and evicted least recently used first */
+typedef struct s_page {
+	unsigned int	file;
+	off_t		offset;
+	size_t		len;
+	unsigned long	stamp;
+	char		*data;
+} page_t;
+
+typedef struct s_page_cache {
+	pthread_mutex_t	mutex;
+	page_t		pages[CACHE_PAGES];
+	unsigned long	clock;
+} page_cache_t;
+
+/* what each row of the terminal shows: a frame only redraws the rows whose
+ * entry or highlighting changed, hence only the new hits while searching */
+typedef struct s_screen_row {
+	int		entry;
+	unsigned int	selected:1;
+} screen_row_t;
+
+/* filter being typed, applied to father once typing pauses, or pattern of
+ * a new search */
+typedef struct s_prompt {
+	WINDOW		*win;
+	search_t	*father;
+	char		text[LINE_MAX];
+	int		len;
+	long		deadline;
+
+	/* why enter did nothing, until the next key */
+	const char	*error;
+
+	/* the pattern of a new search is typed instead */
+	unsigned int	new_search:1;
+} prompt_t;
+
+typedef struct s_screen {
+	screen_row_t	*rows;
+	int		nbrows;
+
+	/* search the rows belong to, NULL when they have to be redrawn */
+	const search_t	*search;
+} screen_t;
+
+/* on-disk trigram index, mapped as is: this header, the file table, the
+ * paths relative to the indexed directory, the trigram table sorted by
+ * trigram and the posting lists of file ids, delta and varint encoded.
+ * An index is made of a base segment and of the segments written by later
+ * updates, whose entries shadow the older ones with the same path */
+typedef struct s_index_header {
+	char		magic[8];
+	uint32_t	flags;
+	uint32_t	nbfiles;
+	uint32_t	nbtrigrams;
+	uint32_t	pad;
+	uint64_t	files;
+	uint64_t	paths;
+	uint64_t	trigrams;
+	uint64_t	postings;
+	uint64_t	size;
+} index_header_t;
+
+/* the file table doubles as a manifest: what stat told when the entry was
+ * indexed says whether it is still up to date */
+typedef struct s_index_file {
+	uint32_t	path;
+	uint32_t	flags;
+	uint32_t	mtime_nsec;
+	uint32_t	pad;
+	uint64_t	ino;
+	uint64_t	size;
+	int64_t		mtime;
+} index_file_t;
+
+typedef struct s_index_trigram {
+	uint32_t	trigram;
+	uint32_t	count;
+	uint64_t	offset;
+} index_trigram_t;
+
+typedef struct s_index {
+	char			*map;
+	size_t			size;
+	const index_header_t	*header;
+	const index_file_t	*files;
+	const char		*paths;
+	const index_trigram_t	*trigrams;
+	const unsigned char	*postings;
+} index_t;
+
+/* live entry of each path across the segments */
+typedef struct s_manifest_slot {
+	const char	*path;
+	uint32_t	segment;
+	uint32_t	id;
+} manifest_slot_t;
+
+typedef struct s_manifest {
+	manifest_slot_t	*slots;
+	uint32_t	size;
+} manifest_t;
+
+/* index a search was seeded from, kept open until its workers are done
+ * checking the entries it had no say on */
+typedef struct s_index_seed {
+	const char	*root;
+	index_t		segments[INDEX_SEGMENTS];
+	unsigned int	nbsegments;
+	manifest_t	manifest;
+} index_seed_t;
+
+/* posting list of a trigram while the index is being built */
+typedef struct s_posting {
+	uint32_t	trigram;
+	uint32_t	count;
+	uint32_t	last;
+	uint32_t	len;
+	uint32_t	size;
+	unsigned char	*buf;
+} posting_t;
+
+typedef struct s_index_build {
+	pthread_mutex_t	mutex;
+	size_t		prefix;
+
+	/* open addressing on the trigram, postings without buf are free */
+	posting_t	*postings;
+	uint32_t	nbpostings;
+	uint32_t	size;
+
+	index_file_t	*files;
+	uint32_t	nbfiles;
+	uint32_t	files_size;
+	char		*paths;
+	size_t		paths_len;
+	size_t		paths_size;
+
+	/* segments already on disk when updating, the entries found
+	 * unchanged by the walk are kept and the others are indexed again */
+	index_t		segments[INDEX_SEGMENTS];
+	unsigned int	nbsegments;
+	manifest_t	manifest;
+	unsigned char	*visited[INDEX_SEGMENTS];
+	uint32_t	nbchanged;
+} index_build_t;
+
+/* trigrams of the file being indexed, each one is listed once */
+typedef struct s_trigrams {
+	uint64_t	*seen;
+	uint32_t	*list;
+	size_t		nblist;
+	size_t		size;
+} trigrams_t;
+
 static search_t			mainsearch;
 static mainsearch_attr_t	mainsearch_attr;
+static pool_t			pool;
+static page_cache_t		page_cache;
+static screen_t			screen;
+static prompt_t			prompt;
+static filelist_t		filelist;
+static pthread_mutex_t		output_mutex;
+static selector_t		selector;
 static search_t			*current;
 static pthread_t		pid;
 
+/* written to by the workers when there is something new to display, and by
+ * the SIGINT handler, so that the main loop only wakes up when needed */
+static int			ui_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t	interrupted;
+
+#ifdef NGP_STATS
+static stats_t			stats;
+static WINDOW			*stats_win;
+static int			stats_report;
+#endif
+
 static void usage(void);
+static int index_seed(const char *dir);
+static void index_check(int worker, batch_t *batch, const work_t *work);
+static void index_unseed(void);
+static void index_build(const char *dir);
+static void index_update(const char *dir);
+static void index_watch(const char *dir);
+static size_t entry_line(const entry_t *entry, char *buf, size_t size);
+static void clean_search(search_t *search);
+static size_t entry_text(const entry_t *entry, const char *path, char *buf,
+		size_t size);
+static void pool_push_slice(int worker, slice_t *slice);
+static int stream_format(int fd);
+static int scan_stream(batch_t *batch, int fd, int format, const char *path);
+#ifdef NGP_STATS
+static int stats_lock(pthread_mutex_t *mutex);
+#endif
+
+
+/*************************** SELECTION ****************************************/
+static uint32_t path_hash(const char *path)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*path)
+		hash = (hash ^ (unsigned char) *path++) * 16777619U;
+	return hash;
+}
+
+static char ** strset_find(const strset_t *set, const char *string)
+{
+	uint32_t i;
+
+	i = path_hash(string) & (set->size - 1);
+	while (set->slots[i] && strcmp(set->slots[i], string))
+		i = (i + 1) & (set->size - 1);
+	return &set->slots[i];
+}
+
+static int strset_has(const strset_t *set, const char *string)
+{
+	return set->nb && *strset_find(set, string) != NULL;
+}
+
+static void strset_add(strset_t *set, const char *string)
+{
+	char		**old, **slot;
+	uint32_t	i, size;
+
+	if (2 * (set->nb + 1) > set->size) {
+		old = set->slots;
+		size = set->size;
+		set->size = size ? size * 2 : 64;
+		set->slots = calloc(set->size, sizeof(char *));
+		for (i = 0; i < size; i++) {
+			if (old[i])
+				*strset_find(set, old[i]) = old[i];
+		}
+		free(old);
+	}
+
+	slot = strset_find(set, string);
+	if (!*slot) {
+		*slot = strdup(string);
+		set->nb++;
+	}
+}
+
+static void strset_free(strset_t *set)
+{
+	uint32_t i;
+
+	for (i = 0; i < set->size; i++)
+		free(set->slots[i]);
+	free(set->slots);
+}
+
+/* suffixes are looked up once per distinct length rather than one by one */
+static void selector_add_suffix(const char *suffix)
+{
+	size_t		len = strlen(suffix);
+	unsigned int	i;
+
+	if (len == 0)
+		return;
+	strset_add(&selector.suffixes, suffix);
+	for (i = 0; i < selector.nblens; i++) {
+		if (selector.lens[i] == len)
+			return;
+	}
+	if (selector.nblens < SUFFIX_LENS)
+		selector.lens[selector.nblens++] = len;
+}
+
+static void selector_add_name(const char *name)
+{
+	strset_add(&selector.names, name);
+}
+
+/* a leading '!' makes an exclude glob, globs holding a '/' are matched
+ * against the path from the searched directory, others against the name */
+static void selector_add_glob(const char *glob)
+{
+	fileglob_t *new;
+
+	selector.globs = realloc(selector.globs,
+		(selector.nbglobs + 1) * sizeof(fileglob_t));
+	new = &selector.globs[selector.nbglobs++];
+	new->exclude = glob[0] == '!';
+	if (new->exclude)
+		glob++;
+	new->pattern = strdup(glob);
+	new->path = strchr(glob, '/') != NULL;
+	if (new->exclude)
+		selector.has_exclude_globs = 1;
+}
+
+static off_t parse_size(const char *size)
+{
+	char			*end;
+	unsigned long long	value;
+
+	value = strtoull(size, &end, 10);
+	switch (*end) {
+	case 'g': case 'G':
+		value *= 1024;
+		/* fall through */
+	case 'm': case 'M':
+		value *= 1024;
+		/* fall through */
+	case 'k': case 'K':
+		value *= 1024;
+		end++;
+		break;
+	}
+	if (end == size || *end)
+		usage();
+	return value;
+}
+
+/* an age such as 2d is turned into the matching mtime */
+static time_t parse_age(const char *age)
+{
+	char		*end;
+	unsigned long	value;
+
+	value = strtoul(age, &end, 10);
+	switch (*end) {
+	case 'w':
+		value *= 7;
+		/* fall through */
+	case 'd':
+		value *= 24;
+		/* fall through */
+	case 'h':
+		value *= 60;
+		/* fall through */
+	case 'm':
+		value *= 60;
+		/* fall through */
+	case 's':
+		end++;
+		break;
+	}
+	if (end == age || *end)
+		usage();
+	return time(NULL) - value;
+}
+
+static int glob_match(const fileglob_t *glob, const char *dir,
+		const char *name, const char *base)
+{
+	char path[PATH_MAX];
+
+	if (!glob->path)
+		return !fnmatch(glob->pattern, base, 0);
+	if (!dir || !*dir)
+		return !fnmatch(glob->pattern, name, 0);
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return !fnmatch(glob->pattern, path, 0);
+}
+
+static int is_glob_excluded(const char *dir, const char *name,
+		const char *base)
+{
+	unsigned int i;
+
+	for (i = 0; selector.has_exclude_globs && i < selector.nbglobs; i++) {
+		if (selector.globs[i].exclude &&
+		    glob_match(&selector.globs[i], dir, name, base))
+			return 1;
+	}
+	return 0;
+}
+
+/* files found through the index were not browsed to, the directories
+ * leading to them are checked along */
+static int is_path_excluded(const char *path)
+{
+	char		dir[PATH_MAX];
+	const char	*slash, *base;
+	size_t		len;
+
+	for (slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+		len = slash - path;
+		if (len >= sizeof(dir))
+			break;
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+		base = strrchr(dir, '/') ? strrchr(dir, '/') + 1 : dir;
+		if (is_glob_excluded(NULL, dir, base))
+			return 1;
+	}
+	return 0;
+}
+
+static int is_dir_selected(const char *dir, const char *name)
+{
+	return selector.all || !is_glob_excluded(dir, name, name);
+}
+
+/* whether name is one of the files looked for, from its name only */
+static int is_name_selected(const char *dir, const char *name)
+{
+	const char	*base;
+	size_t		len;
+	unsigned int	i;
+	int		selected;
+
+	if (selector.all)
+		return 1;
+
+	base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+	selected = mainsearch_attr.raw || strset_has(&selector.names, base);
+
+	len = strlen(base);
+	for (i = 0; !selected && i < selector.nblens; i++) {
+		if (selector.lens[i] <= len)
+			selected = strset_has(&selector.suffixes,
+				base + len - selector.lens[i]);
+	}
+	for (i = 0; !selected && i < selector.nbglobs; i++) {
+		if (!selector.globs[i].exclude)
+			selected = glob_match(&selector.globs[i], dir, name, base);
+	}
+
+	return selected && !is_glob_excluded(dir, name, base) &&
+		!(!dir && selector.has_exclude_globs && is_path_excluded(name));
+}
+
+/* with -z, archives are searched whatever their name, their members are
+ * selected instead; a compressed file is selected as the file it holds */
+static int is_archive_selected(const char *dir, const char *name)
+{
+	static const char	*archives[] = { ".tar", ".tgz", ".tar.gz",
+		".tar.xz", ".tar.zst" };
+	static const char	*compressed[] = { ".gz", ".xz", ".zst" };
+	char			inner[PATH_MAX];
+	const char		*base;
+	size_t			len = strlen(name), n;
+	unsigned int		i;
+
+	if (!mainsearch_attr.decompress)
+		return 0;
+
+	base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+	for (i = 0; i < sizeof(archives) / sizeof(char *); i++) {
+		n = strlen(archives[i]);
+		if (len > n && !strcmp(name + len - n, archives[i]))
+			return !is_glob_excluded(dir, name, base);
+	}
+	for (i = 0; i < sizeof(compressed) / sizeof(char *); i++) {
+		n = strlen(compressed[i]);
+		if (len > n && len - n < sizeof(inner) &&
+		    !strcmp(name + len - n, compressed[i])) {
+			memcpy(inner, name, len - n);
+			inner[len - n] = '\0';
+			return is_name_selected(dir, inner);
+		}
+	}
+	return 0;
+}
+
+/* name is the file name, after the directories leading to it from the
+ * searched one which are either in dir or at the start of name; the stat
+ * needed by the predicates is only made once the name is selected, with
+ * dirfd and path */
+static int is_file_selected(const char *dir, const char *name, int dirfd,
+		const char *path)
+{
+	struct stat st;
+
+	if (selector.all)
+		return 1;
+	if (!is_name_selected(dir, name) && !is_archive_selected(dir, name))
+		return 0;
+
+	if (!selector.has_predicates)
+		return 1;
+	if (fstatat(dirfd, path, &st, 0) < 0)
+		return 0;
+	return (selector.min_size < 0 || st.st_size >= selector.min_size) &&
+		(selector.max_size < 0 || st.st_size <= selector.max_size) &&
+		(!selector.newer || st.st_mtime >= selector.newer) &&
+		(!selector.older || st.st_mtime < selector.older);
+}
+
+static void selector_free(void)
+{
+	unsigned int i;
+
+	strset_free(&selector.suffixes);
+	strset_free(&selector.names);
+	for (i = 0; i < selector.nbglobs; i++)
+		free(selector.globs[i].pattern);
+	free(selector.globs);
+}
+
+
+/*************************** IGNORE *******************************************/
+static const char *ignore_files[] = { ".gitignore", ".ignore", ".ngpignore" };
+
+/* the usual wildcards, none of which matches a '/' but "**" which matches
+ * across directories */
+static int ignore_match(const char *p, const char *s)
+{
+	char		class[LINE_MAX], c[2] = { 0, 0 };
+	const char	*end;
+
+	for (; *p; p++, s++) {
+		switch (*p) {
+		case '*':
+			if (p[1] != '*') {
+				for (;; s++) {
+					if (ignore_match(p + 1, s))
+						return 1;
+					if (!*s || *s == '/')
+						return 0;
+				}
+			}
+			/* "**" followed by '/' also matches no directory */
+			p += 2;
+			if (*p == '/') {
+				for (p++;; s++) {
+					if (ignore_match(p, s))
+						return 1;
+					s = strchr(s, '/');
+					if (!s)
+						return 0;
+				}
+			}
+			for (;; s++) {
+				if (ignore_match(p, s))
+					return 1;
+				if (!*s)
+					return 0;
+			}
+		case '?':
+			if (!*s || *s == '/')
+				return 0;
+			break;
+		case '[':
+			end = p + 1;
+			if (*end == '!' || *end == '^')
+				end++;
+			end = strchr(end + 1, ']');
+			if (end && (size_t) (end - p) < sizeof(class) - 1) {
+				memcpy(class, p, end - p + 1);
+				class[end - p + 1] = '\0';
+				if (class[1] == '^')
+					class[1] = '!';
+				c[0] = *s;
+				if (!*s || *s == '/' || fnmatch(class, c, 0))
+					return 0;
+				p = end;
+				break;
+			}
+			/* no closing bracket, the bracket is taken as is */
+			if (*s != '[')
+				return 0;
+			break;
+		case '\\':
+			if (p[1])
+				p++;
+			/* fall through */
+		default:
+			if (*p != *s)
+				return 0;
+			break;
+		}
+	}
+	return !*s;
+}
+
+static int is_literal(const char *pattern)
+{
+	return !strpbrk(pattern, "*?[\\");
+}
+
+/* one rule per line as in .gitignore: '#' comments, '!' negations, a
+ * trailing '/' for directories only, a '/' elsewhere to anchor the rule
+ * to the directory of the file */
+static void ignore_add_rule(ignore_t *ignore, char *line)
+{
+	ignore_rule_t	*rule;
+	size_t		len = strlen(line);
+
+	if (len > 0 && line[len - 1] == '\r')
+		line[--len] = '\0';
+	while (len > 0 && line[len - 1] == ' ' &&
+	       (len < 2 || line[len - 2] != '\\'))
+		line[--len] = '\0';
+	if (len == 0 || line[0] == '#')
+		return;
+
+	ignore->rules = realloc(ignore->rules,
+		(ignore->nbrules + 1) * sizeof(ignore_rule_t));
+	rule = &ignore->rules[ignore->nbrules];
+	rule->negate = line[0] == '!';
+	if (rule->negate) {
+		line++;
+		len--;
+		ignore->ordered = 1;
+	} else if (line[0] == '\\' && (line[1] == '!' || line[1] == '#')) {
+		line++;
+		len--;
+	}
+	rule->dir_only = len > 0 && line[len - 1] == '/';
+	if (rule->dir_only)
+		line[--len] = '\0';
+	rule->anchored = strchr(line, '/') != NULL;
+	if (line[0] == '/')
+		line++;
+	if (*line == '\0')
+		return;
+	rule->pattern = strdup(line);
+	ignore->nbrules++;
+}
+
+static void ignore_load(ignore_t *ignore, int dirfd, const char *path)
+{
+	struct stat	st;
+	char		*buf, *line, *next;
+	ssize_t		len;
+	int		fd;
+
+	fd = openat(dirfd, path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	buf = malloc(st.st_size + 1);
+	len = read(fd, buf, st.st_size);
+	close(fd);
+	if (len < 0)
+		len = 0;
+	buf[len] = '\0';
+
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		ignore_add_rule(ignore, line);
+	}
+	free(buf);
+}
+
+/* without negation the order of the rules doesn't matter, plain names and
+ * "*.ext" rules are then hashed and only the others are matched in turn */
+static void ignore_compile(ignore_t *ignore)
+{
+	ignore_rule_t	*rule;
+	unsigned int	i, j, nb = 0;
+	size_t		len;
+
+	for (i = 0; !ignore->ordered && i < ignore->nbrules; i++) {
+		rule = &ignore->rules[i];
+		if (rule->anchored) {
+			ignore->rules[nb++] = *rule;
+			continue;
+		}
+		if (is_literal(rule->pattern)) {
+			strset_add(rule->dir_only ? &ignore->dir_names :
+				&ignore->names, rule->pattern);
+		} else if (!rule->dir_only && rule->pattern[0] == '*' &&
+			   is_literal(rule->pattern + 1) &&
+			   ignore->nblens < SUFFIX_LENS) {
+			len = strlen(rule->pattern + 1);
+			strset_add(&ignore->suffixes, rule->pattern + 1);
+			for (j = 0; j < ignore->nblens; j++) {
+				if (ignore->lens[j] == len)
+					break;
+			}
+			if (j == ignore->nblens)
+				ignore->lens[ignore->nblens++] = len;
+		} else {
+			ignore->rules[nb++] = *rule;
+			continue;
+		}
+		free(rule->pattern);
+	}
+	if (!ignore->ordered)
+		ignore->nbrules = nb;
+}
+
+/* rules of the directory base, relative to the searched one, on top of
+ * those of its parent */
+static ignore_t * ignore_new(ignore_t *parent, const char *base)
+{
+	ignore_t *ignore;
+
+	ignore = calloc(1, sizeof(ignore_t));
+	ignore->parent = parent;
+	ignore->base = strdup(base);
+	ignore->refs = 1;
+	if (parent)
+		__atomic_add_fetch(&parent->refs, 1, __ATOMIC_SEQ_CST);
+	return ignore;
+}
+
+static void ignore_release(ignore_t *ignore)
+{
+	ignore_t	*parent;
+	unsigned int	i;
+
+	while (ignore &&
+	       __atomic_sub_fetch(&ignore->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+		parent = ignore->parent;
+		for (i = 0; i < ignore->nbrules; i++)
+			free(ignore->rules[i].pattern);
+		free(ignore->rules);
+		strset_free(&ignore->names);
+		strset_free(&ignore->dir_names);
+		strset_free(&ignore->suffixes);
+		free(ignore->base);
+		free(ignore);
+		ignore = parent;
+	}
+}
+
+/* rules given out of any directory: git's global excludes, ~/.ngpignore
+ * and the excludes of the repository being searched */
+static ignore_t * ignore_global(const char *root)
+{
+	char		path[PATH_MAX];
+	const char	*home = getenv("HOME");
+	const char	*config = getenv("XDG_CONFIG_HOME");
+	ignore_t	*ignore;
+
+	if (mainsearch_attr.no_ignore)
+		return NULL;
+
+	ignore = ignore_new(NULL, "");
+	if (config && *config) {
+		snprintf(path, sizeof(path), "%s/git/ignore", config);
+		ignore_load(ignore, AT_FDCWD, path);
+	} else if (home) {
+		snprintf(path, sizeof(path), "%s/.config/git/ignore", home);
+		ignore_load(ignore, AT_FDCWD, path);
+	}
+	if (home) {
+		snprintf(path, sizeof(path), "%s/.ngpignore", home);
+		ignore_load(ignore, AT_FDCWD, path);
+	}
+	snprintf(path, sizeof(path), "%s/.git/info/exclude", root);
+	ignore_load(ignore, AT_FDCWD, path);
+	ignore_compile(ignore);
+	return ignore;
+}
+
+/* the level for the directory rel, whose ignore files are looked up
+ * through dirfd */
+static ignore_t * ignore_enter(ignore_t *parent, int dirfd, const char *rel)
+{
+	ignore_t	*ignore;
+	unsigned int	i;
+
+	ignore = ignore_new(parent, rel);
+	for (i = 0; i < sizeof(ignore_files) / sizeof(char *); i++)
+		ignore_load(ignore, dirfd, ignore_files[i]);
+	ignore_compile(ignore);
+	return ignore;
+}
+
+/* -1 if no rule of the level matches, 0 if a negated one does */
+static int ignore_level(const ignore_t *ignore, const char *path,
+		const char *name, int isdir)
+{
+	const ignore_rule_t	*rule;
+	size_t			len;
+	unsigned int		i;
+
+	if (strset_has(&ignore->names, name) ||
+	    (isdir && strset_has(&ignore->dir_names, name)))
+		return 1;
+	len = strlen(name);
+	for (i = 0; i < ignore->nblens; i++) {
+		if (ignore->lens[i] <= len &&
+		    strset_has(&ignore->suffixes, name + len - ignore->lens[i]))
+			return 1;
+	}
+
+	/* the last matching rule wins */
+	for (i = ignore->nbrules; i-- > 0;) {
+		rule = &ignore->rules[i];
+		if ((isdir || !rule->dir_only) &&
+		    ignore_match(rule->pattern, rule->anchored ? path : name))
+			return !rule->negate;
+	}
+	return -1;
+}
+
+/* path is the one of the entry from the searched directory, the deepest
+ * level with a matching rule decides */
+static int is_ignored(const ignore_t *ignore, const char *path,
+		const char *name, int isdir)
+{
+	const char	*rel;
+	size_t		len;
+	int		ret;
+
+	for (; ignore; ignore = ignore->parent) {
+		if (ignore->nbrules == 0 && ignore->names.nb == 0 &&
+		    ignore->dir_names.nb == 0 && ignore->suffixes.nb == 0)
+			continue;
+		len = strlen(ignore->base);
+		rel = len ? path + len + 1 : path;
+		ret = ignore_level(ignore, rel, name, isdir);
+		if (ret >= 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* the levels down to rel, for directories reached without browsing their
+ * parents */
+static ignore_t * ignore_chain(const char *root, const char *rel)
+{
+	char		path[PATH_MAX];
+	ignore_t	*ignore, *next;
+	const char	*slash;
+	int		fd;
+
+	ignore = ignore_global(root);
+	if (!ignore)
+		return NULL;
+
+	slash = rel;
+	while (1) {
+		snprintf(path, sizeof(path), "%s/%.*s", root, (int) (slash - rel),
+			rel);
+		fd = open(path, O_RDONLY | O_DIRECTORY);
+		if (fd >= 0) {
+			snprintf(path, sizeof(path), "%.*s", (int) (slash - rel),
+				rel);
+			next = ignore_enter(ignore, fd, path);
+			ignore_release(ignore);
+			ignore = next;
+			close(fd);
+		}
+		if (!*slash)
+			break;
+		slash = strchr(slash + 1, '/');
+		if (!slash)
+			slash = rel + strlen(rel);
+	}
+	return ignore;
+}
 
 
 /*************************** INIT *********************************************/
@@ -147,10 +1499,22 @@ static void init_searchstruct(search_t *searchstruct)
 {
 	searchstruct->index = 0;
 	searchstruct->cursor = 0;
-	searchstruct->size = 100;
+	searchstruct->blocks = NULL;
+	searchstruct->nbblocks = 0;
+	searchstruct->ids = NULL;
+	searchstruct->size = 0;
+	searchstruct->seed = NULL;
+	searchstruct->nbseed = 0;
+	searchstruct->seeded = 0;
+	searchstruct->scanned = 0;
+	searchstruct->arena.first = NULL;
+	searchstruct->arena.last = NULL;
 	searchstruct->nbentry = 0;
 	searchstruct->nb_lines = 0;
 	searchstruct->status = 1;
+	searchstruct->cancel = 0;
+	searchstruct->has_thread = 0;
+	pthread_cond_init(&searchstruct->grown, NULL);
 	searchstruct->is_regex = 0;
 	strcpy(searchstruct->directory, "./");
 	searchstruct->father = NULL;
@@ -171,19 +1535,27 @@ static void ncurses_init()
 	init_pair(3, COLOR_RED, -1);
 	init_pair(4, COLOR_MAGENTA, -1);
 	init_pair(5, COLOR_GREEN, -1);
+
+	/* lines colors when looking for several patterns */
+	init_pair(6, COLOR_CYAN, -1);
+	init_pair(7, COLOR_MAGENTA, -1);
+	init_pair(8, COLOR_RED, -1);
+	init_pair(9, COLOR_BLUE, -1);
+	init_pair(10, COLOR_YELLOW, -1);
 	curs_set(0);
+#ifdef NCURSES_VERSION
+	/* escape closes the filter prompt without a noticeable wait */
+	set_escdelay(25);
+#endif
 }
 
-static const char * get_config(const char *editor, extension_list_t **curext,
-		specific_files_t **curspec)
+static const char * get_config(const char *editor)
 {
 	char *ptr;
 	char *buf;
 	config_t cfg;
 	const char *specific_files;
 	const char *extensions;
-	specific_files_t	*tmpspec;
-	extension_list_t	*tmpext;
 
 	/* grab conf */
 	configuration_init(&cfg);
@@ -200,16 +1572,7 @@ static const char * get_config(const char *editor, extension_list_t **curext,
 	/* get specific files names from configuration */
 	ptr = strtok_r((char *) specific_files, " ", &buf);
 	while (ptr != NULL) {
-		tmpspec = malloc(sizeof(specific_files_t));
-		if (!mainsearch_attr.firstspec) {
-			mainsearch_attr.firstspec = tmpspec;
-		} else {
-			(*curspec)->next = tmpspec;
-		}
-
-		strncpy(tmpspec->spec, ptr, LINE_MAX);
-		tmpspec->next = NULL;
-		*curspec = tmpspec;
+		selector_add_name(ptr);
 		ptr = strtok_r(NULL, " ", &buf);
 	}
 
@@ -221,16 +1584,7 @@ static const char * get_config(const char *editor, extension_list_t **curext,
 
 	ptr = strtok_r((char *) extensions, " ", &buf);
 	while (ptr != NULL) {
-		tmpext = malloc(sizeof(extension_list_t));
-		if (!mainsearch_attr.firstext) {
-			mainsearch_attr.firstext = tmpext;
-		} else {
-			(*curext)->next = tmpext;
-		}
-
-		strncpy(tmpext->ext, ptr, LINE_MAX);
-		tmpext->next = NULL;
-		*curext = tmpext;
+		selector_add_suffix(ptr);
 		ptr = strtok_r(NULL, " ", &buf);
 	}
 
@@ -249,13 +1603,59 @@ static ino_t get_inode_from_path(const char *path)
 	return buf.st_ino;
 }
 
-static void get_args(int argc, char *argv[], extension_list_t **curext, exclude_list_t **curexcl)
+static void add_pattern(const char *pattern)
+{
+	mainsearch_attr.patterns = realloc(mainsearch_attr.patterns,
+		(mainsearch_attr.nbpatterns + 1) * sizeof(char *));
+	mainsearch_attr.patterns[mainsearch_attr.nbpatterns++] =
+		strndup(pattern, LINE_MAX - 1);
+}
+
+/* one pattern per line, empty lines are ignored */
+static int read_patterns(const char *path)
+{
+	FILE	*f;
+	char	line[LINE_MAX];
+	size_t	len;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len > 0)
+			add_pattern(line);
+	}
+	fclose(f);
+	return 0;
+}
+
+static void get_args(int argc, char *argv[], exclude_list_t **curexcl)
 {
 	int opt;
 	exclude_list_t		*tmpexcl;
-	extension_list_t	*tmpext;
+	static const struct option long_options[] = {
+		{ "index",	required_argument,	NULL,	OPT_INDEX },
+		{ "no-index",	no_argument,		NULL,	OPT_NO_INDEX },
+		{ "min-size",	required_argument,	NULL,	OPT_MIN_SIZE },
+		{ "max-size",	required_argument,	NULL,	OPT_MAX_SIZE },
+		{ "newer",	required_argument,	NULL,	OPT_NEWER },
+		{ "older",	required_argument,	NULL,	OPT_OLDER },
+		{ "no-ignore",	no_argument,		NULL,	OPT_NO_IGNORE },
+		{ "print",	no_argument,		NULL,	OPT_PRINT },
+		{ "json",	no_argument,		NULL,	OPT_JSON },
+		{ "null",	no_argument,		NULL,	OPT_NULL },
+#ifdef NGP_STATS
+		{ "stats",	no_argument,		NULL,	OPT_STATS },
+#endif
+		{ NULL,		0,			NULL,	0 }
+	};
 
-	while ((opt = getopt(argc, argv, "hit:refx:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "hit:refbx:j:p:P:g:z",
+	    long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -264,12 +1664,10 @@ static void get_args(int argc, char *argv[], extension_list_t **curext, exclude_
 			strcpy(mainsearch.options, "-i");
 			break;
 		case 't':
-			//FIXME: maybe the LL is empty hehe ...
-			tmpext = malloc(sizeof(extension_list_t));
-			strncpy(tmpext->ext, optarg, LINE_MAX);
-			tmpext->next = NULL;
-			(*curext)->next = tmpext;
-			*curext = tmpext;
+			selector_add_suffix(optarg);
+			break;
+		case 'g':
+			selector_add_glob(optarg);
 			break;
 		case 'r':
 			mainsearch_attr.raw = 1;
@@ -280,6 +1678,12 @@ static void get_args(int argc, char *argv[], extension_list_t **curext, exclude_
 		case 'f':
 			mainsearch_attr.follow_symlinks = 1;
 			break;
+		case 'b':
+			mainsearch_attr.binary = 1;
+			break;
+		case 'z':
+			mainsearch_attr.decompress = 1;
+			break;
 		case 'x':
 			tmpexcl = malloc(sizeof(exclude_list_t));
 			if (!mainsearch_attr.firstexcl) {
@@ -293,6 +1697,67 @@ static void get_args(int argc, char *argv[], extension_list_t **curext, exclude_
 			tmpexcl->next = NULL;
 			*curexcl = tmpexcl;
 			break;
+		case 'j':
+			mainsearch_attr.nbworkers = atoi(optarg);
+			if (mainsearch_attr.nbworkers < 1)
+				usage();
+			break;
+		case 'p':
+			add_pattern(optarg);
+			break;
+		case 'P':
+			if (read_patterns(optarg) < 0) {
+				fprintf(stderr, "ngp: cannot read patterns from %s\n",
+					optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_INDEX:
+			if (!strcmp(optarg, "build"))
+				mainsearch_attr.index_action = INDEX_BUILD;
+			else if (!strcmp(optarg, "update"))
+				mainsearch_attr.index_action = INDEX_UPDATE;
+			else if (!strcmp(optarg, "watch"))
+				mainsearch_attr.index_action = INDEX_WATCH;
+			else
+				usage();
+			break;
+		case OPT_NO_INDEX:
+			mainsearch_attr.no_index = 1;
+			break;
+		case OPT_MIN_SIZE:
+			selector.min_size = parse_size(optarg);
+			selector.has_predicates = 1;
+			break;
+		case OPT_MAX_SIZE:
+			selector.max_size = parse_size(optarg);
+			selector.has_predicates = 1;
+			break;
+		case OPT_NEWER:
+			selector.newer = parse_age(optarg);
+			selector.has_predicates = 1;
+			break;
+		case OPT_OLDER:
+			selector.older = parse_age(optarg);
+			selector.has_predicates = 1;
+			break;
+		case OPT_NO_IGNORE:
+			mainsearch_attr.no_ignore = 1;
+			break;
+		case OPT_PRINT:
+			mainsearch_attr.output = OUTPUT_PRINT;
+			break;
+		case OPT_JSON:
+			mainsearch_attr.output = OUTPUT_JSON;
+			break;
+		case OPT_NULL:
+			mainsearch_attr.output = OUTPUT_NULL;
+			break;
+#ifdef NGP_STATS
+		case OPT_STATS:
+			stats_report = 1;
+			break;
+#endif
 		default:
 			exit(-1);
 			break;
@@ -302,16 +1767,70 @@ static void get_args(int argc, char *argv[], extension_list_t **curext, exclude_
 
 
 /*************************** UTILS ********************************************/
-static int is_file(int index, search_t *cursearch)
+static inline int is_cancelled(void)
 {
-	return cursearch->entries[index].isfile;
+	return __atomic_load_n(&pool.cancel, __ATOMIC_RELAXED);
 }
 
-static int isfile(char *nodename)
+static long now_ms(void)
 {
-	struct stat buf;
+	struct timespec ts;
 
-	stat(nodename, &buf);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* safe from a signal handler; a full pipe already has the main loop awake,
+ * the byte can be dropped then */
+static void ui_wake(void)
+{
+	char	c = 0;
+	int	saved = errno;
+	ssize_t	ret;
+
+	if (ui_pipe[1] < 0)
+		return;
+	ret = write(ui_pipe[1], &c, 1);
+	S_VAR_NOT_USED(ret);
+	errno = saved;
+}
+
+static void ui_pipe_init(void)
+{
+	int i;
+
+	if (pipe(ui_pipe) < 0) {
+		fprintf(stderr, "ngp: cannot create pipe\n");
+		exit(-1);
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(ui_pipe[i], F_SETFL, fcntl(ui_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(ui_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+}
+
+/* index of an entry of search among the ones of mainsearch */
+static inline uint32_t entry_id(const search_t *search, unsigned int index)
+{
+	return search->father ? search->ids[index] : index;
+}
+
+static inline entry_t * get_entry(const search_t *search, unsigned int index)
+{
+	index = entry_id(search, index);
+	return &mainsearch.blocks[index / ENTRY_BLOCK][index % ENTRY_BLOCK];
+}
+
+static int is_file(int index, search_t *cursearch)
+{
+	return get_entry(cursearch, index)->isfile;
+}
+
+static int isfile(char *nodename)
+{
+	struct stat buf;
+
+	stat(nodename, &buf);
 	return !S_ISDIR(buf.st_mode);
 }
 
@@ -341,29 +1860,6 @@ static int is_dir_special (const char *dir) {
 		strcmp(dir, ".svn"));
 }
 
-static int is_simlink(char *file_path)
-{
-	struct stat filestat;
-
-	lstat(file_path, &filestat);
-	return S_ISLNK(filestat.st_mode);
-}
-
-static int is_specific_file(const char *name)
-{
-	char *name_begins;
-	specific_files_t *curspec;
-
-	curspec = mainsearch_attr.firstspec;
-	while (curspec) {
-		name_begins = (strrchr(name, '/') != NULL) ? strrchr(name, '/') + 1 : (char *) name;
-		if (!strncmp(name_begins, curspec->spec, LINE_MAX))
-			return 1;
-		curspec = curspec->next;
-	}
-	return 0;
-}
-
 static char * remove_double_appearance(char *initial, char c, char *final)
 {
 	int i, j;
@@ -387,24 +1883,37 @@ static char * remove_double_appearance(char *initial, char c, char *final)
 	return final;
 }
 
-static char * extract_line_number(char *line)
-{
-	char *token;
-	char *buffer;
-	token = strtok_r(line, " :", &buffer);
-	return token;
-}
-
 static void usage(void)
 {
-	fprintf(stderr, "usage: ngp [options]... pattern [directory/file]\n\n");
+	fprintf(stderr, "usage: ngp [options]... pattern [directory/file]\n");
+	fprintf(stderr, "       ngp [options]... -p pattern... [directory/file]\n");
+	fprintf(stderr, "       ngp [options]... --index build|update|watch [directory]\n\n");
 	fprintf(stderr, "options:\n");
 	fprintf(stderr, " -i : ignore case distinctions in pattern\n");
 	fprintf(stderr, " -r : raw mode\n");
 	fprintf(stderr, " -t type : look for a file extension only\n");
-	fprintf(stderr, " -e : pattern is a regexp\n");
+	fprintf(stderr, " -e : pattern is an extended regexp\n");
 	fprintf(stderr, " -x folder : exclude directory from search\n");
+	fprintf(stderr, " -g glob : search files matching glob too, or skip them with !glob\n");
+	fprintf(stderr, " --min-size size, --max-size size : only search files this big (k, M, G)\n");
+	fprintf(stderr, " --newer age, --older age : only search files modified since (s, m, h, d, w)\n");
+	fprintf(stderr, " --no-ignore : search files listed in .gitignore, .ignore and .ngpignore too\n");
 	fprintf(stderr, " -f : follow symlinks (default doesn't)\n");
+	fprintf(stderr, " -b : search binary files too, only telling whether they match\n");
+	fprintf(stderr, " -z : search inside compressed files and tar archives too\n");
+	fprintf(stderr, " -j workers : number of search threads (default is one per cpu)\n");
+	fprintf(stderr, " -p pattern : look for this pattern too, can be repeated\n");
+	fprintf(stderr, " -P file : look for the patterns listed in file, one per line\n");
+	fprintf(stderr, " --index build : index directory to speed up later searches\n");
+	fprintf(stderr, " --index update : only index again what changed since last time\n");
+	fprintf(stderr, " --index watch : keep updating the index as files change\n");
+	fprintf(stderr, " --no-index : browse directory even if it has an index\n");
+	fprintf(stderr, " --print : write file:line:text of each hit to stdout, without the ui\n");
+	fprintf(stderr, " --null : same, with a nul byte after the file name\n");
+	fprintf(stderr, " --json : same, a json object per hit\n");
+#ifdef NGP_STATS
+	fprintf(stderr, " --stats : tell where the time went when leaving, 's' shows it as it goes\n");
+#endif
 	exit(-1);
 }
 
@@ -446,102 +1955,166 @@ static void open_entry(int index, const char *editor, const char *pattern)
 {
 	char command[PATH_MAX];
 	char filtered_file_name[PATH_MAX];
-	char line_copy[PATH_MAX];
+	char line_number[16];
 	int file_index;
 	pthread_mutex_t *mutex;
-	char *sanitized_pattern;
-
-	sanitized_pattern = vim_sanitize(pattern);
+	char *sanitized_pattern = NULL;
 
 	file_index = find_file(index);
 	synchronized(mainsearch.data_mutex) {
-		strcpy(line_copy, current->entries[index].data);
-		snprintf(command, sizeof(command), editor,
-			extract_line_number(line_copy),
-			remove_double_appearance(
-				current->entries[file_index].data, '/',
-				filtered_file_name),
-			sanitized_pattern);
+		remove_double_appearance(get_entry(current, file_index)->data,
+			'/', filtered_file_name);
+		/* members of an archive, found with -z, can't be edited */
+		if (strchr(filtered_file_name, '!') &&
+		    access(filtered_file_name, F_OK) < 0) {
+			sanitized_pattern = NULL;
+		} else {
+			/* jump to the pattern which matched this very line */
+			if (current == &mainsearch &&
+			    mainsearch_attr.nbpatterns > 1)
+				pattern = mainsearch_attr.patterns[get_entry(current, index)->pattern];
+			sanitized_pattern = vim_sanitize(pattern);
+			snprintf(line_number, sizeof(line_number), "%u",
+				get_entry(current, index)->line);
+			snprintf(command, sizeof(command), editor,
+				line_number, filtered_file_name,
+				sanitized_pattern);
+		}
 	}
+	if (!sanitized_pattern)
+		return;
 	system(command);
 	free(sanitized_pattern);
 }
 
 
 /*************************** DISPLAY ******************************************/
-static void printl(int *y, const char *line)
+static void printl(int *y, const entry_t *entry)
 {
-	int crop = COLS;
-	char cropped_line[PATH_MAX];
+	char line[PATH_MAX];
 	char filtered_line[PATH_MAX];
-	char *pos;
-	char *buf;
-	int length=0;
-
-	strncpy(cropped_line, line, crop);
-	cropped_line[COLS] = '\0';
-
-	if (isdigit(cropped_line[0])) {
-		pos = strtok_r(cropped_line, ":", &buf);
-		attron(COLOR_PAIR(2));
-		mvprintw(*y, 0, "%s:", pos);
-		length = strlen(pos) + 1;
-		attron(COLOR_PAIR(1));
-		mvprintw(*y, length, "%s", cropped_line + length);
-	} else {
+	int length, crop, color;
+	size_t len;
+
+	move(*y, 0);
+	clrtoeol();
+
+	if (entry->isfile) {
 		attron(COLOR_PAIR(5));
-		mvprintw(*y, 0, "%s", cropped_line,
-			remove_double_appearance(cropped_line, '/', filtered_line));
+		mvprintw(*y, 0, "%.*s", COLS,
+			remove_double_appearance(entry->data, '/', filtered_line));
+		return;
+	}
+
+	if (entry->binary) {
+		attron(COLOR_PAIR(4));
+		mvprintw(*y, 0, "%.*s", COLS, entry->data);
+		return;
 	}
+
+	attron(COLOR_PAIR(2));
+	mvprintw(*y, 0, "%u:", entry->line);
+	getyx(stdscr, *y, length);
+
+	crop = COLS - length;
+	if (crop < 0)
+		crop = 0;
+	if (crop >= (int) sizeof(line))
+		crop = sizeof(line) - 1;
+	len = entry_line(entry, line, crop + 1);
+
+	if (mainsearch_attr.nbpatterns > 1)
+		color = 6 + entry->pattern % 5;
+	else
+		color = 1;
+	attron(COLOR_PAIR(color));
+	if (entry->match_len == 0 || entry->match >= len) {
+		printw("%s", line);
+		return;
+	}
+
+	/* highlight the match itself, it may be cropped */
+	printw("%.*s", entry->match, line);
+	if (color == 1)
+		attron(COLOR_PAIR(3));
+	attron(A_UNDERLINE);
+	printw("%.*s", entry->match_len, line + entry->match);
+	attroff(A_UNDERLINE);
+	attron(COLOR_PAIR(color));
+	if (entry->match + entry->match_len < len)
+		printw("%s", line + entry->match + entry->match_len);
 }
 
 static void display_entry(int *y, int *index, int color)
 {
-	char filtered_line[PATH_MAX];
+	entry_t *entry;
 
 	if ((unsigned) *index < current->nbentry) {
-		if (!is_file(*index, current)) {
+		entry = get_entry(current, *index);
+		if (!entry->isfile) {
 			if (color == 1) {
 				attron(A_REVERSE);
-				printl(y, current->entries[*index].data);
+				printl(y, entry);
 				attroff(A_REVERSE);
 			} else {
-				printl(y, current->entries[*index].data);
+				printl(y, entry);
 			}
 		} else {
 			attron(A_BOLD);
-			printl(y, remove_double_appearance(current->entries[*index].data, '/', filtered_line));
+			printl(y, entry);
 			attroff(A_BOLD);
 		}
 	}
 }
 
+/* only the rows which changed since the last call are drawn */
 static void display_entries(int *index, int *cursor)
 {
-	int i = 0;
-	int ptr = 0;
+	screen_row_t	row;
+	int		i, ptr;
+
+	if (screen.nbrows != LINES) {
+		screen.rows = realloc(screen.rows, LINES * sizeof(screen_row_t));
+		screen.nbrows = LINES;
+		screen.search = NULL;
+	}
 
 	for (i = 0; i < LINES; i++) {
 		ptr = *index + i;
-		if (i == *cursor) {
-			display_entry(&i, &ptr, 1);
+		row.entry = (unsigned) ptr < current->nbentry ? ptr : -1;
+		row.selected = i == *cursor;
+		if (screen.search == current &&
+		    screen.rows[i].entry == row.entry &&
+		    screen.rows[i].selected == row.selected)
+			continue;
+
+		screen.rows[i] = row;
+		if (row.entry < 0) {
+			move(i, 0);
+			clrtoeol();
 		} else {
-			display_entry(&i, &ptr, 0);
+			display_entry(&i, &ptr, row.selected);
 		}
 	}
+	screen.search = current;
 }
 
-static void resize(int *index, int *cursor)
+/* the next display_entries draws every row again */
+static void screen_clear(void)
 {
 	clear();
+	screen.search = NULL;
+}
+
+static void resize(int *index, int *cursor)
+{
+	screen_clear();
 	display_entries(index, cursor);
 	refresh();
 }
 
 static void page_up(int *index, int *cursor)
 {
-	clear();
-	refresh();
 	if (*index == 0)
 		*cursor = 0;
 	else
@@ -572,8 +2145,6 @@ static void page_down(int *index, int *cursor)
 	else
 		*cursor = 0;
 
-	clear();
-	refresh();
 	*index += LINES;
 	*index = (*index > max_index ? max_index : *index);
 
@@ -633,7 +2204,7 @@ static void display_status(void)
 
 	char nbhits[15];
 	attron(COLOR_PAIR(1));
-	if (mainsearch.status)
+	if (current->status)
 		mvaddstr(0, COLS - 1, rollingwheel[++i%4]);
 	else
 		mvaddstr(0, COLS - 5, "Done.");
@@ -642,494 +2213,5005 @@ static void display_status(void)
 }
 
 
-/*************************** MEMORY HANDLING **********************************/
-static void check_alloc(search_t *toinc, int size)
+#ifdef NGP_STATS
+/*************************** STATS ********************************************/
+static uint64_t now_ns(void)
 {
-	if (toinc->nbentry >= toinc->size) {
-		toinc->size += size;
-		toinc->entries = realloc(toinc->entries, toinc->size * sizeof(entry_t));
-	}
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static void mainsearch_add_file(const char *file)
+/* only a lock that is held gets its wait timed */
+static int stats_lock(pthread_mutex_t *mutex)
 {
-	char	*new_file;
+	uint64_t	start;
+	int		ret;
 
-	check_alloc(&mainsearch, 500);
-	new_file = malloc(PATH_MAX * sizeof(char));
-	strncpy(new_file, file, PATH_MAX);
-	mainsearch.entries[mainsearch.nbentry].data = new_file;
-	mainsearch.entries[mainsearch.nbentry].isfile = 1;
-	mainsearch.nbentry++;
+	if (pthread_mutex_trylock(mutex) == 0)
+		return 0;
+	start = now_ns();
+	ret = pthread_mutex_lock(mutex);
+	STAT_TIME(lock_wait_ns, start);
+	STAT_ADD(lock_waits, 1);
+	return ret;
 }
 
-static void mainsearch_add_line(const char *line)
+static void stats_latency(uint64_t start)
 {
-	char	*new_line;
+	uint64_t	us = (now_ns() - start) / 1000;
+	unsigned int	bucket = 0;
 
-	check_alloc(&mainsearch, 500);
-	new_line = malloc(LINE_MAX * sizeof(char));
-	strncpy(new_line, line, LINE_MAX);
-	mainsearch.entries[mainsearch.nbentry].data = new_line;
-	mainsearch.entries[mainsearch.nbentry].isfile = 0;
-	mainsearch.nbentry++;
-	mainsearch.nb_lines++;
-		if (mainsearch.nbentry <= (unsigned) (current->index + LINES)
-			&& current == &mainsearch)
-		display_entries(&mainsearch.index, &mainsearch.cursor);
+	while (us && bucket < STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	STAT_ADD(latency[bucket], 1);
 }
 
-
-/*************************** PARSING ******************************************/
-static int is_regex_valid(search_t *cursearch)
+static uint64_t stats_get(const uint64_t *counter)
 {
-	regex_t	*reg;
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
 
-	reg = malloc(sizeof(regex_t));
-	if (regcomp(reg, cursearch->pattern, 0)) {
-		free(reg);
-		return 0;
-	} else {
-		cursearch->regex = reg;
+/* one line per counter, then one per latency bucket holding files; the
+ * panel and --stats show the same lines */
+static unsigned int stats_lines(char lines[][40], unsigned int max)
+{
+	static const struct {
+		const char	*name;
+		size_t		offset;
+		int		is_time;
+	} counters[] = {
+		{ "dirs visited",	offsetof(stats_t, dirs), 0 },
+		{ "files visited",	offsetof(stats_t, files_visited), 0 },
+		{ "files skipped",	offsetof(stats_t, files_skipped), 0 },
+		{ "files opened",	offsetof(stats_t, files_opened), 0 },
+		{ "binary files",	offsetof(stats_t, files_binary), 0 },
+		{ "bytes read",		offsetof(stats_t, bytes_read), 0 },
+		{ "lines scanned",	offsetof(stats_t, lines_scanned), 0 },
+		{ "matches",		offsetof(stats_t, matches), 0 },
+		{ "walk ms",		offsetof(stats_t, walk_ns), 1 },
+		{ "open ms",		offsetof(stats_t, open_ns), 1 },
+		{ "match ms",		offsetof(stats_t, match_ns), 1 },
+		{ "lock waits",		offsetof(stats_t, lock_waits), 0 },
+		{ "lock wait ms",	offsetof(stats_t, lock_wait_ns), 1 },
+		{ "frames",		offsetof(stats_t, frames), 0 },
+		{ "render ms",		offsetof(stats_t, render_ns), 1 },
+	};
+	const uint64_t	*counter;
+	unsigned int	i, n = 0;
+	uint64_t	value;
+
+	for (i = 0; i < sizeof(counters) / sizeof(*counters) && n < max; i++) {
+		counter = (const uint64_t *) ((const char *) &stats +
+			counters[i].offset);
+		value = stats_get(counter);
+		if (counters[i].is_time)
+			snprintf(lines[n++], 40, "%-16s %14.1f",
+				counters[i].name, value / 1e6);
+		else
+			snprintf(lines[n++], 40, "%-16s %14llu",
+				counters[i].name, (unsigned long long) value);
 	}
-
-	return 1;
+	for (i = 0; i < STATS_BUCKETS && n < max; i++) {
+		value = stats_get(&stats.latency[i]);
+		if (value)
+			snprintf(lines[n++], 40, "files < %-8llu %14llu",
+				1ULL << i, (unsigned long long) value);
+	}
+	if (n < max && n > sizeof(counters) / sizeof(*counters))
+		snprintf(lines[n++], 40, "(file latency in us)");
+	return n;
 }
 
-static char * regex(const char *line, const char *pattern)
+/* drawn over the results on the right, below the status, while open */
+static void stats_draw(void)
 {
-	int ret;
-
-	S_VAR_NOT_USED(pattern);
-	ret = regexec(current->regex, line, 0, NULL, 0);
+	char		lines[64][40];
+	unsigned int	i, n;
 
-	if (ret != REG_NOMATCH)
-		return "1";
-	else
-		return NULL;
+	if (!stats_win)
+		return;
+	n = LINES > 4 ? LINES - 4 : 0;
+	n = stats_lines(lines, n < 64 ? n : 64);
+	wresize(stats_win, n + 2, 34);
+	mvwin(stats_win, 2, COLS > 34 ? COLS - 34 : 0);
+	werase(stats_win);
+	box(stats_win, 0, 0);
+	for (i = 0; i < n; i++)
+		mvwaddnstr(stats_win, i + 1, 1, lines[i], 32);
+	touchwin(stats_win);
+	wrefresh(stats_win);
 }
 
-static int parse_file(const char *file, const char *pattern, char *options)
+static void stats_toggle(void)
 {
-	FILE *f;
-	char line[LINE_MAX];
-	char full_line[LINE_MAX];
-	int first;
-	int line_number;
-	char * (*parser)(const char *, const char*);
-	errno = 0;
+	pthread_mutex_t	*mutex;
 
-	f = fopen(file, "r");
-	if (f == NULL) {
-		return -1;
+	if (stats_win) {
+		delwin(stats_win);
+		stats_win = NULL;
+		synchronized(mainsearch.data_mutex) {
+			screen_clear();
+			display_entries(&current->index, &current->cursor);
+		}
+		refresh();
+		return;
 	}
+	stats_win = newwin(3, 34, 2, COLS > 34 ? COLS - 34 : 0);
+	stats_draw();
+}
 
-	if (strstr(options, "-i") == NULL) {
-		parser = strstr;
-	} else {
-		parser = strcasestr;
-	}
+static void stats_dump(void)
+{
+	char		lines[64][40];
+	unsigned int	i, n;
 
-	if (current->is_regex) {
-		parser = regex;
-	}
+	n = stats_lines(lines, 64);
+	for (i = 0; i < n; i++)
+		fprintf(stderr, "%s\n", lines[i]);
+}
+#endif
 
-	first = 1;
-	line_number = 1;
-	while (fgets(line, sizeof(line), f)) {
-		if (parser(line, pattern) != NULL) {
-			if (first) {
-				mainsearch_add_file(file);
-				first = 0;
-			}
-			if (line[strlen(line) - 2] == '\r')
-				line[strlen(line) - 2] = '\0';
-			snprintf(full_line, LINE_MAX, "%d:%s", line_number, line);
-			mainsearch_add_line(full_line);
-		}
-		/* check line has a \n */
-		//FIXME this is ugly
-		if (line[strlen(line) - 1] == '\n')
-			line_number++;
-		memset(line, 0, LINE_MAX);
+
+/*************************** MEMORY HANDLING **********************************/
+static char * arena_alloc(arena_t *arena, size_t len)
+{
+	chunk_t	*chunk = arena->first;
+	size_t	size;
+
+	if (!chunk || chunk->size - chunk->used < len) {
+		size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+		chunk = malloc(sizeof(chunk_t) + size);
+		chunk->used = 0;
+		chunk->size = size;
+		chunk->next = arena->first;
+		arena->first = chunk;
+		if (!arena->last)
+			arena->last = chunk;
 	}
-	fclose(f);
-	return 0;
+
+	chunk->used += len;
+	return chunk->data + chunk->used - len;
 }
 
-static void lookup_file(const char *file, const char *pattern, char *options)
+static char * arena_strndup(arena_t *arena, const char *str, size_t len)
 {
-	errno = 0;
-	pthread_mutex_t		*mutex;
-	extension_list_t	*curext;
+	char *new_str;
 
-	if (mainsearch_attr.raw) {
-		synchronized(mainsearch.data_mutex)
-			parse_file(file, pattern, options);
-		return;
-	}
+	new_str = arena_alloc(arena, len + 1);
+	memcpy(new_str, str, len);
+	new_str[len] = '\0';
+	return new_str;
+}
 
-	if (is_specific_file(file)) {
-		synchronized(mainsearch.data_mutex)
-			parse_file(file, pattern, options);
+/* hand every chunk of src over to dst */
+static void arena_splice(arena_t *dst, arena_t *src)
+{
+	if (!src->first)
 		return;
-	}
 
-	curext = mainsearch_attr.firstext;
-	while (curext) {
-		if (!strcmp(curext->ext, file + strlen(file) - strlen(curext->ext))) {
-				synchronized(mainsearch.data_mutex)
-				parse_file(file, pattern, options);
-			break;
-		}
-		curext = curext->next;
+	src->last->next = dst->first;
+	dst->first = src->first;
+	if (!dst->last)
+		dst->last = src->last;
+	src->first = NULL;
+	src->last = NULL;
+}
+
+static void arena_free(arena_t *arena)
+{
+	chunk_t *chunk;
+
+	while (arena->first) {
+		chunk = arena->first;
+		arena->first = chunk->next;
+		free(chunk);
 	}
+	arena->last = NULL;
 }
 
-static void lookup_directory(const char *dir, const char *pattern, char *options)
+/* only the small table of blocks is ever reallocated, entries stay put */
+static void search_add_entry(search_t *search, const entry_t *entry)
 {
-	DIR *dp;
+	if (search->nbentry == search->nbblocks * ENTRY_BLOCK) {
+		search->blocks = realloc(search->blocks,
+			(search->nbblocks + 1) * sizeof(entry_t *));
+		search->blocks[search->nbblocks++] =
+			malloc(ENTRY_BLOCK * sizeof(entry_t));
+	}
 
-	dp = opendir(dir);
-	if (!dp) {
-		return;
+	*get_entry(search, search->nbentry) = *entry;
+	search->nbentry++;
+	if (!entry->isfile)
+		search->nb_lines++;
+}
+
+/* subsearches share the entries of mainsearch, id is the index of one */
+static void search_add_id(search_t *search, uint32_t id)
+{
+	if (search->nbentry == search->size) {
+		search->size = search->size ? search->size * 2 : 1024;
+		search->ids = realloc(search->ids,
+			search->size * sizeof(uint32_t));
 	}
 
-	while (1) {
-		struct dirent *ep;
-		ep = readdir(dp);
+	search->ids[search->nbentry++] = id;
+	if (!get_entry(search, search->nbentry - 1)->isfile)
+		search->nb_lines++;
+}
 
-		if (!ep)
-			break;
+/* without the ui nothing is kept, records are written out a buffer at a
+ * time; a reader gone away ends ngp with SIGPIPE */
+static void output_flush(batch_t *batch)
+{
+	pthread_mutex_t	*mutex;
+	size_t		done = 0;
+	ssize_t		ret;
 
-		/* file */
-		if (!(ep->d_type & DT_DIR)) {
-			char file_path[PATH_MAX];
-			snprintf(file_path, PATH_MAX, "%s/%s", dir,
-				ep->d_name);
+	if (batch->outlen == 0)
+		return;
 
-			if (!is_simlink(file_path) || mainsearch_attr.follow_symlinks)
-				lookup_file(file_path, pattern, options);
+	synchronized(output_mutex) {
+		while (done < batch->outlen) {
+			ret = write(STDOUT_FILENO, batch->out + done,
+				batch->outlen - done);
+			if (ret < 0 && errno != EINTR)
+				break;
+			if (ret > 0)
+				done += ret;
 		}
+		mainsearch.nb_lines += batch->outhits;
+	}
+	batch->outlen = 0;
+	batch->outhits = 0;
+}
 
-		/* directory */
-		if (ep->d_type&DT_DIR && !is_dir_special(ep->d_name)) {
-			if (!is_dir_exclude(ep->d_ino)) {
-				char path_dir[PATH_MAX] = "";
-				snprintf(path_dir, PATH_MAX, "%s/%s", dir, ep->d_name);
-				lookup_directory(path_dir, pattern, options);
-			}
-		}
+static void output_append(batch_t *batch, const char *str, size_t len)
+{
+	if (batch->outlen + len > batch->outsize) {
+		while (batch->outlen + len > batch->outsize)
+			batch->outsize = batch->outsize ? batch->outsize * 2 :
+				2 * OUTPUT_BUF;
+		batch->out = realloc(batch->out, batch->outsize);
 	}
-	closedir(dp);
+	memcpy(batch->out + batch->outlen, str, len);
+	batch->outlen += len;
 }
 
-static void * lookup_thread(void *arg)
+static void output_json_string(batch_t *batch, const char *str, size_t len)
 {
-	search_t *d = (search_t *) arg;
+	char	escape[8];
+	size_t	i, start = 0;
+
+	output_append(batch, "\"", 1);
+	for (i = 0; i < len; i++) {
+		if ((unsigned char) str[i] >= ' ' && str[i] != '"' &&
+		    str[i] != '\\')
+			continue;
+		output_append(batch, str + start, i - start);
+		if (str[i] == '"' || str[i] == '\\')
+			snprintf(escape, sizeof(escape), "\\%c", str[i]);
+		else
+			snprintf(escape, sizeof(escape), "\\u%04x",
+				(unsigned char) str[i]);
+		output_append(batch, escape, strlen(escape));
+		start = i + 1;
+	}
+	output_append(batch, str + start, len - start);
+	output_append(batch, "\"", 1);
+}
 
-	if (isfile(d->directory)) {
-		parse_file(d->directory, d->pattern, d->options);
+/* file:line:text with --print, a nul byte after the file with --null, and
+ * a json object per line with --json; the column is left out when the
+ * matcher gives no span, the dfa only knows where a match ends */
+static void output_hit(batch_t *batch, unsigned int line_number,
+		const char *line, size_t len, size_t match, size_t match_len)
+{
+	char	prefix[64];
+	int	n;
+
+	if (mainsearch_attr.output == OUTPUT_JSON) {
+		output_append(batch, "{\"file\":", 8);
+		output_json_string(batch, batch->path, strlen(batch->path));
+		if (batch->binary) {
+			output_append(batch, ",\"binary\":true}\n", 16);
+		} else {
+			n = snprintf(prefix, sizeof(prefix), ",\"line\":%u",
+				line_number);
+			output_append(batch, prefix, n);
+			if (match_len) {
+				n = snprintf(prefix, sizeof(prefix),
+					",\"column\":%zu", match + 1);
+				output_append(batch, prefix, n);
+			}
+			output_append(batch, ",\"text\":", 8);
+			output_json_string(batch, line, len);
+			output_append(batch, "}\n", 2);
+		}
 	} else {
-		lookup_directory(d->directory, d->pattern, d->options);
+		output_append(batch, batch->path, strlen(batch->path));
+		output_append(batch,
+			mainsearch_attr.output == OUTPUT_NULL ? "" : ":", 1);
+		if (batch->binary) {
+			output_append(batch, line, len);
+		} else {
+			n = snprintf(prefix, sizeof(prefix), "%u:", line_number);
+			output_append(batch, prefix, n);
+			output_append(batch, line, len);
+		}
+		output_append(batch, "\n", 1);
 	}
 
-	d->status = 0;
-	return (void *) NULL;
+	batch->outhits++;
+	if (batch->outlen >= OUTPUT_BUF)
+		output_flush(batch);
 }
 
+/* hits of a file are gathered without holding data_mutex, then published
+ * all at once: the lock is only held to append entries */
+static entry_t * batch_new_line(batch_t *batch)
+{
+	if (batch->nblines >= batch->size) {
+		batch->size = batch->size ? batch->size * 2 : 64;
+		batch->lines = realloc(batch->lines, batch->size * sizeof(entry_t));
+	}
+	return &batch->lines[batch->nblines++];
+}
 
-/*************************** SUBSEARCH ****************************************/
-static void subsearch_window(char *search)
+static void batch_add_line(batch_t *batch, unsigned int line_number,
+		off_t offset, const char *line, size_t len, size_t match,
+		size_t match_len, unsigned int pattern)
 {
-	WINDOW	*searchw;
-	int	j = 0, car;
+	entry_t *entry;
 
-	searchw = newwin(3, 50, (LINES-3)/2 , (COLS-50)/2);
-	box(searchw, 0,0);
-	wrefresh(searchw);
-	refresh();
+	STAT_ADD(matches, 1);
+	line_number += batch->line_base;
+	if (mainsearch_attr.output && !batch->collect) {
+		output_hit(batch, line_number, line, len, match, match_len);
+		return;
+	}
 
-	mvwprintw(searchw, 1, 1, "To search:");
-	while ((car = wgetch(searchw)) != '\n' && j < LINE_MAX) {
-		if (car == 8 || car == 127) { //backspace
-			if (j > 0)
-				search[--j] = 0;
-			mvwprintw(searchw, 1, 1, "To search: %s ", search);
-			continue;
-		}
+	entry = batch_new_line(batch);
+	entry->data = NULL;
+	if (batch->keep_text)
+		entry->data = arena_strndup(&batch->arena, line, len);
+	entry->offset = offset;
+	entry->line = line_number;
+	entry->file = 0;
+	if (match > USHRT_MAX || match_len > USHRT_MAX)
+		match = match_len = 0;
+	entry->match = match;
+	entry->match_len = match_len;
+	entry->pattern = pattern;
+	entry->binary = batch->binary;
+	entry->isfile = 0;
+}
 
-		if (car == 27) { //escape
-			memset(search, 0, LINE_MAX);
-			break;
-		}
+static void mainsearch_publish(batch_t *batch, const char *file)
+{
+	pthread_mutex_t	*mutex;
+	entry_t		new_file;
+	unsigned int	i;
+
+	if (batch->nblines == 0)
+		return;
 
-		search[j++] = car;
-		mvwprintw(searchw, 1, 1, "To search: %s", search);
+	memset(&new_file, 0, sizeof(new_file));
+	new_file.data = arena_strndup(&batch->arena, file, strlen(file));
+	new_file.isfile = 1;
+	synchronized(mainsearch.data_mutex) {
+		for (i = 0; i < batch->nblines; i++)
+			batch->lines[i].file = mainsearch.nbentry;
+		search_add_entry(&mainsearch, &new_file);
+		for (i = 0; i < batch->nblines; i++)
+			search_add_entry(&mainsearch, &batch->lines[i]);
+		pthread_cond_broadcast(&mainsearch.grown);
 	}
-	search[j] = 0;
-	delwin(searchw);
+	batch->nblines = 0;
+
+	/* the main loop draws the new hits with the next frame */
+	ui_wake();
 }
 
-static search_t * subsearch(search_t *father)
+/* lines are read back through a small cache of file pages: the display
+ * walks results in order, so neighbouring hits mostly share pages */
+static page_t * cache_page(unsigned int file, const char *path, off_t offset)
 {
-	search_t	*child;
-	unsigned int	i;
-	char		*search;
-	bool		orphan_file = 0;
-	char		*new_data;
+	page_t	*page, *victim = NULL;
+	ssize_t	ret;
+	int	fd, i;
+
+	for (i = 0; i < CACHE_PAGES; i++) {
+		page = &page_cache.pages[i];
+		if (page->data && page->file == file && page->offset == offset) {
+			page->stamp = ++page_cache.clock;
+			return page;
+		}
+		if (!victim || page->stamp < victim->stamp)
+			victim = page;
+	}
 
-	search = malloc(LINE_MAX * sizeof(char));
-	memset(search, 0, LINE_MAX);
-	subsearch_window(search);
+	if (!victim->data)
+		victim->data = malloc(CACHE_PAGE);
+	victim->stamp = 0;
+	victim->offset = -1;
+	victim->len = 0;
 
-	/*Verify search is not empty*/
-	if (search[0] == 0)
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
 		return NULL;
+	do {
+		ret = pread(fd, victim->data + victim->len,
+			CACHE_PAGE - victim->len, offset + victim->len);
+		if (ret > 0)
+			victim->len += ret;
+	} while ((ret > 0 && victim->len < CACHE_PAGE) ||
+		 (ret < 0 && errno == EINTR));
+	close(fd);
+
+	victim->file = file;
+	victim->offset = offset;
+	victim->stamp = ++page_cache.clock;
+	return victim;
+}
 
-	/* create and init subsearch */
-	if ((child = malloc(sizeof(search_t))) == NULL)
-		exit(1);
+/* copy the text of a line into buf, which is always nul terminated, and
+ * return its length, truncated to size - 1 */
+static size_t entry_line(const entry_t *entry, char *buf, size_t size)
+{
+	return entry_text(entry, get_entry(&mainsearch, entry->file)->data,
+		buf, size);
+}
 
-	init_searchstruct(child);
-	child->father = father;
-	father->child = child;
-	child->entries = calloc(100, sizeof(entry_t));
-	strncpy(child->pattern, search, LINE_MAX);
-	free(search);
+/* entry_line, for callers which don't hold data_mutex and know the path
+ * of the file from its own entry */
+static size_t entry_text(const entry_t *entry, const char *path, char *buf,
+		size_t size)
+{
+	pthread_mutex_t	*mutex;
+	const char	*start, *eol;
+	page_t		*page;
+	off_t		offset = entry->offset;
+	size_t		len = 0, n;
 
-	if (!is_regex_valid(child))
-		return NULL;
-	current = child;
-
-	for (i = 0; i < father->nbentry; i++) {
-		if (is_file(i, father)) {
-			/* previous file had no entries, free it */
-			if (orphan_file)
-				free(new_data);
-
-			/* prepare entry.data but don't add it yet */
-			new_data = malloc(LINE_MAX * sizeof(char));
-			strncpy(new_data, father->entries[i].data, LINE_MAX);
-			orphan_file = 1;
-		} else if (regex(father->entries[i].data, child->pattern)) {
-			//check_alloc(child, 100); //FIXME this should work ...
-			if (child->nbentry%100 >= 98) {
-				child->size += 100;
-				child->entries = realloc(child->entries, child->size * sizeof(entry_t));
-			}
-			/* file has entries, add it */
-			if (orphan_file) {
-				child->entries[child->nbentry].data = new_data;
-				child->entries[child->nbentry].isfile = 1;
-				child->nbentry++;
-				orphan_file = 0;
-			}
-			/* now add line */
-			new_data = malloc(LINE_MAX * sizeof(char));
-			strncpy(new_data, father->entries[i].data, LINE_MAX);
-			child->entries[child->nbentry].data = new_data;
-			child->entries[child->nbentry].isfile = 0;
-			child->nb_lines++;
-			child->nbentry++;
-		}
+	if (size == 0)
+		return 0;
+
+	if (entry->data) {
+		len = strnlen(entry->data, size - 1);
+		memcpy(buf, entry->data, len);
+		buf[len] = '\0';
+		return len;
 	}
 
-	child->entries = realloc(child->entries, child->nbentry * sizeof(entry_t));
-	child->size = child->nbentry;
+	synchronized(page_cache.mutex) {
+		while (len < size - 1) {
+			page = cache_page(entry->file, path,
+				offset - offset % CACHE_PAGE);
+			if (!page || (size_t) (offset % CACHE_PAGE) >= page->len)
+				break;
+
+			start = page->data + offset % CACHE_PAGE;
+			n = page->data + page->len - start;
+			if (n > size - 1 - len)
+				n = size - 1 - len;
+			eol = memchr(start, '\n', n);
+			if (eol)
+				n = eol - start;
+			memcpy(buf + len, start, n);
+			len += n;
+			offset += n;
+			if (eol || page->len < CACHE_PAGE)
+				break;
+		}
+	}
 
-	return child;
+	if (len > 0 && buf[len - 1] == '\r')
+		len--;
+	buf[len] = '\0';
+	return len;
 }
 
 
-/*************************** CLEANUP ******************************************/
-static void clean_search(search_t *search)
+/*************************** LITERALS *****************************************/
+static inline unsigned char fold(unsigned char c)
 {
-	unsigned int i;
+	return (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+}
+
+static inline unsigned char unfold(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
 
-	for (i = 0; i < search->nbentry; i++) {
-		free(search->entries[i].data);
+/* rough frequency of a byte in source code, the lower the rarer */
+static int byte_rank(unsigned char c)
+{
+	static const char common[] = "etaoinsrlcdhpumfgbywvkxjqz";
+	const char *pos;
+
+	if (c == ' ' || c == '\t' || c == '\n')
+		return 255;
+	if (c >= 'a' && c <= 'z') {
+		pos = strchr(common, c);
+		return 230 - 4 * (pos - common);
 	}
-	free(search->entries);
-	free(search->regex);
-//	free(search); //wont work cuz mainsearch ain't no pointer yo
+	if (c && strchr("(),;._=*/-\"{}", c))
+		return 150;
+	if (c >= 'A' && c <= 'Z')
+		return 100;
+	if (c >= '0' && c <= '9')
+		return 90;
+	return 40;
 }
 
-static void clean_all(void)
+static int literal_verify(const literal_t *literal, const char *p)
 {
-	search_t	*next;
-	exclude_list_t	*curex, *tmpex;
-	extension_list_t *curext, *tmpext;
-	specific_files_t *curspec, *tmpspec;
+	size_t i;
 
-	/* free linked list of excludes, extensions, specifics */
-	curex = mainsearch_attr.firstexcl;
-	while (curex) {
-		tmpex = curex;
-		curex = curex->next;
-		free(tmpex);
-	}
+	if (!literal->icase)
+		return !memcmp(p, literal->pattern, literal->len);
 
-	curext = mainsearch_attr.firstext;
-	while (curext) {
-		tmpext = curext;
-		curext = curext->next;
-		free(tmpext);
+	for (i = 0; i < literal->len; i++) {
+		if (fold(p[i]) != fold(literal->pattern[i]))
+			return 0;
 	}
+	return 1;
+}
 
-	curspec = mainsearch_attr.firstspec;
-	while (curspec) {
-		tmpspec = curspec;
-		curspec = curspec->next;
-		free(tmpspec);
-	}
+static const char * literal_find_scalar(const literal_t *literal,
+		const char *buf, size_t len)
+{
+	const char	*p, *last;
+	unsigned char	lower, upper;
 
-	next = current->father;
-	while (next) {
-		next = current->father;
-		clean_search(current);
-		current = next;
+	if (!literal->icase || literal->len == 0)
+		return memmem(buf, len, literal->pattern, literal->len);
+	if (len < literal->len)
+		return NULL;
+
+	lower = fold(literal->pattern[literal->rare1]);
+	upper = unfold(lower);
+	last = buf + len - literal->len;
+	for (p = buf; p <= last; p++) {
+		if ((unsigned char) p[literal->rare1] != lower &&
+		    (unsigned char) p[literal->rare1] != upper)
+			continue;
+		if (literal_verify(literal, p))
+			return p;
 	}
+	return NULL;
 }
 
-static void ncurses_stop()
+#ifdef NGP_SIMD_X86
+/* compare the two rare bytes of the pattern against 16 candidate
+ * positions at once, only verify positions where both are found */
+__attribute__((target("sse2")))
+static const char * literal_find_sse2(const literal_t *literal,
+		const char *buf, size_t len)
 {
-	endwin();
+	const char	*p = buf, *last;
+	unsigned char	c1, c2;
+	unsigned int	mask;
+	__m128i		lower1, upper1, lower2, upper2, b1, b2, eq;
+
+	if (len < literal->len + 15)
+		return literal_find_scalar(literal, buf, len);
+
+	c1 = literal->pattern[literal->rare1];
+	c2 = literal->pattern[literal->rare2];
+	if (literal->icase) {
+		c1 = fold(c1);
+		c2 = fold(c2);
+	}
+	lower1 = _mm_set1_epi8(c1);
+	lower2 = _mm_set1_epi8(c2);
+	upper1 = _mm_set1_epi8(literal->icase ? unfold(c1) : c1);
+	upper2 = _mm_set1_epi8(literal->icase ? unfold(c2) : c2);
+
+	last = buf + len - literal->len - 15;
+	for (; p <= last; p += 16) {
+		b1 = _mm_loadu_si128((const __m128i *) (p + literal->rare1));
+		b2 = _mm_loadu_si128((const __m128i *) (p + literal->rare2));
+		eq = _mm_and_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(b1, lower1),
+				_mm_cmpeq_epi8(b1, upper1)),
+			_mm_or_si128(_mm_cmpeq_epi8(b2, lower2),
+				_mm_cmpeq_epi8(b2, upper2)));
+		mask = _mm_movemask_epi8(eq);
+		while (mask) {
+			if (literal_verify(literal, p + __builtin_ctz(mask)))
+				return p + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+
+	return literal_find_scalar(literal, p, buf + len - p);
 }
 
-static void sig_handler(int signo)
+__attribute__((target("avx2")))
+static const char * literal_find_avx2(const literal_t *literal,
+		const char *buf, size_t len)
 {
-	if (signo == SIGINT) {
-		pthread_kill(pid, SIGINT);
-		ncurses_stop();
-		clean_all();
-		exit(-1);
+	const char	*p = buf, *last;
+	unsigned char	c1, c2;
+	unsigned int	mask;
+	__m256i		lower1, upper1, lower2, upper2, b1, b2, eq;
+
+	if (len < literal->len + 31)
+		return literal_find_sse2(literal, buf, len);
+
+	c1 = literal->pattern[literal->rare1];
+	c2 = literal->pattern[literal->rare2];
+	if (literal->icase) {
+		c1 = fold(c1);
+		c2 = fold(c2);
+	}
+	lower1 = _mm256_set1_epi8(c1);
+	lower2 = _mm256_set1_epi8(c2);
+	upper1 = _mm256_set1_epi8(literal->icase ? unfold(c1) : c1);
+	upper2 = _mm256_set1_epi8(literal->icase ? unfold(c2) : c2);
+
+	last = buf + len - literal->len - 31;
+	for (; p <= last; p += 32) {
+		b1 = _mm256_loadu_si256((const __m256i *) (p + literal->rare1));
+		b2 = _mm256_loadu_si256((const __m256i *) (p + literal->rare2));
+		eq = _mm256_and_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(b1, lower1),
+				_mm256_cmpeq_epi8(b1, upper1)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(b2, lower2),
+				_mm256_cmpeq_epi8(b2, upper2)));
+		mask = _mm256_movemask_epi8(eq);
+		while (mask) {
+			if (literal_verify(literal, p + __builtin_ctz(mask)))
+				return p + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
 	}
-}
 
+	return literal_find_sse2(literal, p, buf + len - p);
+}
+#endif
 
-int main(int argc, char *argv[])
+static void literal_init(literal_t *literal, const char *pattern, int icase)
 {
-	int ch;
+	size_t	i;
+	int	rank1 = 256, rank2 = 256, rank;
+
+	literal->pattern = pattern;
+	literal->len = strlen(pattern);
+	literal->icase = icase;
+	literal->rare1 = 0;
+	literal->rare2 = 0;
+
+	/* pick the two rarest bytes, at different offsets */
+	for (i = 0; i < literal->len; i++) {
+		rank = byte_rank(icase ? fold(pattern[i]) : pattern[i]);
+		if (rank < rank1) {
+			literal->rare2 = literal->rare1;
+			rank2 = rank1;
+			literal->rare1 = i;
+			rank1 = rank;
+		} else if (rank < rank2) {
+			literal->rare2 = i;
+			rank2 = rank;
+		}
+	}
+	if (literal->len > 1 && literal->rare1 == literal->rare2)
+		literal->rare2 = literal->len - 1;
+
+	literal->find = literal_find_scalar;
+	if (literal->len == 0)
+		return;
+
+#ifdef NGP_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		literal->find = literal_find_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		literal->find = literal_find_sse2;
+#endif
+}
+
+
+static void ac_grow(ac_t *ac, unsigned int *size)
+{
+	unsigned int i;
+
+	*size *= 2;
+	ac->delta = realloc(ac->delta, *size * ac->nbclasses * sizeof(int));
+	ac->out = realloc(ac->out, *size * sizeof(int));
+	for (i = ac->nbstates * ac->nbclasses; i < *size * ac->nbclasses; i++)
+		ac->delta[i] = -1;
+}
+
+static void ac_init(ac_t *ac, char **patterns, unsigned int nbpatterns,
+		int icase)
+{
+	unsigned int	i, c, size = 64;
+	unsigned int	head, tail, *queue;
+	int		*fail, state, next;
+	const char	*p;
+	unsigned char	b;
+
+	/* bytes not found in any pattern all share class 0 */
+	memset(ac->classes, 0, sizeof(ac->classes));
+	ac->nbclasses = 1;
+	for (i = 0; i < nbpatterns; i++) {
+		for (p = patterns[i]; *p; p++) {
+			b = icase ? fold(*p) : (unsigned char) *p;
+			if (ac->classes[b])
+				continue;
+			ac->classes[b] = ac->nbclasses;
+			if (icase)
+				ac->classes[unfold(b)] = ac->nbclasses;
+			ac->nbclasses++;
+		}
+	}
+
+	/* trie of the patterns */
+	ac->delta = malloc(size * ac->nbclasses * sizeof(int));
+	ac->out = malloc(size * sizeof(int));
+	for (i = 0; i < size * ac->nbclasses; i++)
+		ac->delta[i] = -1;
+	ac->nbstates = 1;
+	ac->out[0] = -1;
+	ac->lens = malloc(nbpatterns * sizeof(size_t));
+
+	for (i = 0; i < nbpatterns; i++) {
+		state = 0;
+		for (p = patterns[i]; *p; p++) {
+			c = ac->classes[(unsigned char) *p];
+			next = ac->delta[state * ac->nbclasses + c];
+			if (next < 0) {
+				if (ac->nbstates == size)
+					ac_grow(ac, &size);
+				next = ac->nbstates++;
+				ac->out[next] = -1;
+				ac->delta[state * ac->nbclasses + c] = next;
+			}
+			state = next;
+		}
+		ac->lens[i] = p - patterns[i];
+		if (ac->out[state] < 0)
+			ac->out[state] = i;
+	}
+
+	/* breadth first walk to turn the trie into an automaton: missing
+	 * transitions go where the failure link would lead, and each state
+	 * reports the first pattern ending at it or at its failure states */
+	fail = malloc(ac->nbstates * sizeof(int));
+	queue = malloc(ac->nbstates * sizeof(unsigned int));
+	head = tail = 0;
+	fail[0] = 0;
+	for (c = 0; c < ac->nbclasses; c++) {
+		next = ac->delta[c];
+		if (next < 0) {
+			ac->delta[c] = 0;
+		} else {
+			fail[next] = 0;
+			queue[tail++] = next;
+		}
+	}
+
+	while (head < tail) {
+		state = queue[head++];
+		if (ac->out[fail[state]] >= 0 &&
+		    (ac->out[state] < 0 || ac->out[fail[state]] < ac->out[state]))
+			ac->out[state] = ac->out[fail[state]];
+
+		for (c = 0; c < ac->nbclasses; c++) {
+			next = ac->delta[state * ac->nbclasses + c];
+			if (next < 0) {
+				ac->delta[state * ac->nbclasses + c] =
+					ac->delta[fail[state] * ac->nbclasses + c];
+			} else {
+				fail[next] = ac->delta[fail[state] * ac->nbclasses + c];
+				queue[tail++] = next;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+}
+
+static const char * ac_find(const ac_t *ac, const char *buf, size_t len,
+		unsigned int *pattern)
+{
+	size_t	i;
+	int	state = 0;
+
+	/* an empty pattern matches right away */
+	if (ac->out[0] >= 0) {
+		*pattern = ac->out[0];
+		return buf;
+	}
+
+	for (i = 0; i < len; i++) {
+		state = ac->delta[state * ac->nbclasses +
+			ac->classes[(unsigned char) buf[i]]];
+		if (ac->out[state] >= 0) {
+			*pattern = ac->out[state];
+			return buf + i + 1 - ac->lens[*pattern];
+		}
+	}
+	return NULL;
+}
+
+
+/*************************** REGEX ********************************************/
+#define RE_MAX_NODES	2000
+#define DFA_MAX_STATES	2048
+#define RE_SYNTAX	1
+#define RE_UNSUPPORTED	2
+
+static inline void set_add(unsigned char *set, unsigned char c)
+{
+	set[c >> 3] |= 1 << (c & 7);
+}
+
+static inline int set_has(const unsigned char *set, unsigned char c)
+{
+	return set[c >> 3] & (1 << (c & 7));
+}
+
+static rnode_t * re_node(rparser_t *parser, int type, rnode_t *left,
+		rnode_t *right)
+{
+	rnode_t *node;
+
+	if (++parser->nbnodes > RE_MAX_NODES)
+		parser->error = RE_UNSUPPORTED;
+
+	node = calloc(1, sizeof(rnode_t));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	node->chain = parser->nodes;
+	parser->nodes = node;
+	return node;
+}
+
+static rnode_t * re_clone(rparser_t *parser, const rnode_t *node)
+{
+	rnode_t *clone;
+
+	if (!node)
+		return NULL;
+	clone = re_node(parser, node->type, re_clone(parser, node->left),
+		re_clone(parser, node->right));
+	memcpy(clone->set, node->set, sizeof(clone->set));
+	return clone;
+}
+
+static void re_fold_set(unsigned char *set)
+{
+	int c;
+
+	for (c = 'a'; c <= 'z'; c++) {
+		if (set_has(set, c) || set_has(set, unfold(c))) {
+			set_add(set, c);
+			set_add(set, unfold(c));
+		}
+	}
+}
+
+static rnode_t * re_set(rparser_t *parser, int (*class)(int), int negate)
+{
+	rnode_t	*node;
+	int	c;
+
+	node = re_node(parser, RE_SET, NULL, NULL);
+	for (c = 0; c < 256; c++) {
+		if (!!class(c) == negate)
+			continue;
+		set_add(node->set, c);
+	}
+	node->set['\n' >> 3] &= ~(1 << ('\n' & 7));
+	return node;
+}
+
+static int is_word(int c)
+{
+	return isalnum(c) || c == '_';
+}
+
+static int is_any(int c)
+{
+	return c != '\n';
+}
+
+static const struct {
+	const char	*name;
+	int		(*class)(int);
+} re_classes[] = {
+	{ "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+	{ "upper", isupper }, { "lower", islower }, { "space", isspace },
+	{ "blank", isblank }, { "punct", ispunct }, { "print", isprint },
+	{ "graph", isgraph }, { "cntrl", iscntrl }, { "xdigit", isxdigit },
+	{ NULL, NULL }
+};
+
+/* bracket expression, parser->p points right after '[' */
+static rnode_t * re_parse_class(rparser_t *parser)
+{
+	rnode_t		*node;
+	int		negate = 0, first = 1, i, c, last;
+	const char	*end;
+	size_t		len;
+
+	node = re_node(parser, RE_SET, NULL, NULL);
+	if (*parser->p == '^') {
+		negate = 1;
+		parser->p++;
+	}
+
+	while (*parser->p && (first || *parser->p != ']')) {
+		first = 0;
+		if (parser->p[0] == '[' && parser->p[1] == ':') {
+			end = strstr(parser->p + 2, ":]");
+			if (!end) {
+				parser->error = RE_SYNTAX;
+				return node;
+			}
+			len = end - parser->p - 2;
+			for (i = 0; re_classes[i].name; i++) {
+				if (strlen(re_classes[i].name) == len &&
+				    !strncmp(re_classes[i].name, parser->p + 2, len))
+					break;
+			}
+			if (!re_classes[i].name) {
+				parser->error = RE_SYNTAX;
+				return node;
+			}
+			for (c = 0; c < 128; c++) {
+				if (re_classes[i].class(c))
+					set_add(node->set, c);
+			}
+			parser->p = end + 2;
+			continue;
+		}
+
+		/* collating elements and equivalence classes */
+		if (parser->p[0] == '[' &&
+		    (parser->p[1] == '.' || parser->p[1] == '=')) {
+			parser->error = RE_UNSUPPORTED;
+			return node;
+		}
+
+		c = (unsigned char) *parser->p++;
+		if (parser->p[0] == '-' && parser->p[1] && parser->p[1] != ']') {
+			last = (unsigned char) parser->p[1];
+			parser->p += 2;
+			if (last < c) {
+				parser->error = RE_SYNTAX;
+				return node;
+			}
+			for (; c <= last; c++)
+				set_add(node->set, c);
+		} else {
+			set_add(node->set, c);
+		}
+	}
+
+	if (*parser->p != ']') {
+		parser->error = RE_SYNTAX;
+		return node;
+	}
+	parser->p++;
+
+	if (parser->icase)
+		re_fold_set(node->set);
+	if (negate) {
+		for (i = 0; i < 32; i++)
+			node->set[i] = ~node->set[i];
+		node->set['\n' >> 3] &= ~(1 << ('\n' & 7));
+	}
+	return node;
+}
+
+static rnode_t * re_parse_alt(rparser_t *parser);
+
+static rnode_t * re_parse_atom(rparser_t *parser)
+{
+	rnode_t		*node;
+	unsigned char	c = *parser->p++;
+
+	switch (c) {
+	case '(':
+		node = re_parse_alt(parser);
+		if (*parser->p != ')')
+			parser->error = RE_SYNTAX;
+		else
+			parser->p++;
+		return node;
+	case '[':
+		return re_parse_class(parser);
+	case '.':
+		return re_set(parser, is_any, 0);
+	case '^':
+		return re_node(parser, RE_BOL, NULL, NULL);
+	case '$':
+		return re_node(parser, RE_EOL, NULL, NULL);
+	case '\\':
+		c = *parser->p++;
+		switch (c) {
+		case '\0':
+			parser->error = RE_SYNTAX;
+			parser->p--;
+			return re_node(parser, RE_EMPTY, NULL, NULL);
+		case 'w':
+		case 'W':
+			return re_set(parser, is_word, c == 'W');
+		case 's':
+		case 'S':
+			return re_set(parser, isspace, c == 'S');
+		case 'd':
+		case 'D':
+			return re_set(parser, isdigit, c == 'D');
+		default:
+			/* back references and word boundaries */
+			if (isdigit(c) || strchr("bB<>`'", c))
+				parser->error = RE_UNSUPPORTED;
+			break;
+		}
+		break;
+	}
+
+	node = re_node(parser, RE_SET, NULL, NULL);
+	set_add(node->set, c);
+	if (parser->icase)
+		re_fold_set(node->set);
+	return node;
+}
+
+/* x{min,max} is unrolled into min copies of x followed by max - min
+ * nested optional copies, or by x* when there is no upper bound */
+static rnode_t * re_repeat(rparser_t *parser, rnode_t *atom, int min, int max)
+{
+	rnode_t	*node = NULL, *tail = NULL;
+	int	i;
+
+	if (max < 0) {
+		tail = re_node(parser, RE_STAR, re_clone(parser, atom), NULL);
+	} else {
+		for (i = min; i < max && !parser->error; i++) {
+			tail = tail ? re_node(parser, RE_CAT,
+				re_clone(parser, atom), tail) :
+				re_clone(parser, atom);
+			tail = re_node(parser, RE_QUEST, tail, NULL);
+		}
+	}
+
+	for (i = 0; i < min && !parser->error; i++) {
+		node = node ? re_node(parser, RE_CAT, node,
+			re_clone(parser, atom)) : re_clone(parser, atom);
+	}
+
+	if (node && tail)
+		return re_node(parser, RE_CAT, node, tail);
+	if (node || tail)
+		return node ? node : tail;
+	return re_node(parser, RE_EMPTY, NULL, NULL);
+}
+
+static rnode_t * re_parse_repeat(rparser_t *parser)
+{
+	rnode_t	*node;
+	char	*end;
+	long	min, max;
+
+	node = re_parse_atom(parser);
+	while (!parser->error) {
+		switch (*parser->p) {
+		case '*':
+			node = re_node(parser, RE_STAR, node, NULL);
+			break;
+		case '+':
+			node = re_node(parser, RE_PLUS, node, NULL);
+			break;
+		case '?':
+			node = re_node(parser, RE_QUEST, node, NULL);
+			break;
+		case '{':
+			min = strtol(parser->p + 1, &end, 10);
+			if (end == parser->p + 1) {
+				parser->error = RE_UNSUPPORTED;
+				return node;
+			}
+			max = min;
+			if (*end == ',') {
+				max = -1;
+				if (isdigit(end[1]))
+					max = strtol(end + 1, &end, 10);
+				else
+					end++;
+			}
+			if (*end != '}' || min > 255 || max > 255 ||
+			    (max >= 0 && max < min)) {
+				parser->error = RE_UNSUPPORTED;
+				return node;
+			}
+			parser->p = end;
+			node = re_repeat(parser, node, min, max);
+			break;
+		default:
+			return node;
+		}
+		parser->p++;
+	}
+	return node;
+}
+
+static rnode_t * re_parse_cat(rparser_t *parser)
+{
+	rnode_t *node = NULL, *next;
+
+	/* a leading repetition operator is undefined in ERE */
+	if (*parser->p && strchr("*+?{", *parser->p))
+		parser->error = RE_UNSUPPORTED;
+
+	while (*parser->p && *parser->p != '|' && *parser->p != ')' &&
+	       !parser->error) {
+		next = re_parse_repeat(parser);
+		node = node ? re_node(parser, RE_CAT, node, next) : next;
+	}
+	return node ? node : re_node(parser, RE_EMPTY, NULL, NULL);
+}
+
+static rnode_t * re_parse_alt(rparser_t *parser)
+{
+	rnode_t *node;
+
+	node = re_parse_cat(parser);
+	while (*parser->p == '|' && !parser->error) {
+		parser->p++;
+		node = re_node(parser, RE_ALT, node, re_parse_cat(parser));
+	}
+	return node;
+}
+
+static void re_free(rparser_t *parser)
+{
+	rnode_t *node;
+
+	while (parser->nodes) {
+		node = parser->nodes;
+		parser->nodes = node->chain;
+		free(node);
+	}
+}
+
+/* the only byte a set matches, case being ignored with -i */
+static int re_single(const unsigned char *set, int icase)
+{
+	int c, found = -1;
+
+	for (c = 0; c < 256; c++) {
+		if (!set_has(set, c))
+			continue;
+		if (icase && found >= 0 && fold(c) == fold(found))
+			continue;
+		if (found >= 0)
+			return -1;
+		found = icase ? fold(c) : c;
+	}
+	return found;
+}
+
+static char * str_cat(const char *a, const char *b)
+{
+	char *s;
+
+	s = malloc(strlen(a) + strlen(b) + 1);
+	strcpy(s, a);
+	strcat(s, b);
+	return s;
+}
+
+static const char * str_longest(const char *a, const char *b)
+{
+	return strlen(b) > strlen(a) ? b : a;
+}
+
+static void rinfo_free(rinfo_t *info)
+{
+	free(info->exact);
+	free(info->prefix);
+	free(info->suffix);
+	free(info->req);
+}
+
+static void re_info(const rnode_t *node, int icase, rinfo_t *info)
+{
+	rinfo_t		l, r;
+	char		*mid, c[2] = { 0, 0 };
+	size_t		i, j, la, lb;
+	int		single;
+	const char	*best;
+
+	switch (node->type) {
+	case RE_SET:
+		single = re_single(node->set, icase);
+		if (single > 0) {
+			c[0] = single;
+			info->exact = strdup(c);
+		} else {
+			info->exact = NULL;
+		}
+		info->prefix = strdup(c);
+		info->suffix = strdup(c);
+		info->req = strdup(c);
+		return;
+	case RE_CAT:
+		re_info(node->left, icase, &l);
+		re_info(node->right, icase, &r);
+		info->exact = (l.exact && r.exact) ? str_cat(l.exact, r.exact) : NULL;
+		info->prefix = l.exact ? str_cat(l.exact, r.prefix) : strdup(l.prefix);
+		info->suffix = r.exact ? str_cat(l.suffix, r.exact) : strdup(r.suffix);
+		mid = str_cat(l.suffix, r.prefix);
+		best = str_longest(str_longest(l.req, r.req), mid);
+		best = str_longest(best, str_longest(info->prefix, info->suffix));
+		info->req = strdup(best);
+		free(mid);
+		break;
+	case RE_ALT:
+		re_info(node->left, icase, &l);
+		re_info(node->right, icase, &r);
+		info->exact = (l.exact && r.exact && !strcmp(l.exact, r.exact)) ?
+			strdup(l.exact) : NULL;
+		for (i = 0; l.prefix[i] && l.prefix[i] == r.prefix[i]; i++)
+			;
+		info->prefix = strndup(l.prefix, i);
+		la = strlen(l.suffix);
+		lb = strlen(r.suffix);
+		for (j = 0; j < la && j < lb &&
+		     l.suffix[la - j - 1] == r.suffix[lb - j - 1]; j++)
+			;
+		info->suffix = strdup(l.suffix + la - j);
+		info->req = strdup(str_longest(info->prefix, info->suffix));
+		break;
+	case RE_PLUS:
+		re_info(node->left, icase, info);
+		free(info->exact);
+		info->exact = NULL;
+		return;
+	case RE_STAR:
+	case RE_QUEST:
+		info->exact = NULL;
+		info->prefix = strdup("");
+		info->suffix = strdup("");
+		info->req = strdup("");
+		return;
+	default:
+		info->exact = strdup("");
+		info->prefix = strdup("");
+		info->suffix = strdup("");
+		info->req = strdup("");
+		return;
+	}
+
+	rinfo_free(&l);
+	rinfo_free(&r);
+}
+
+/* every match contains one of the returned literals, or NULL when some
+ * alternative has no required literal at all */
+static int re_required(const rnode_t *node, int icase, char ***required,
+		unsigned int *nbrequired)
+{
+	rinfo_t info;
+
+	if (node->type == RE_ALT) {
+		if (re_required(node->left, icase, required, nbrequired) < 0)
+			return -1;
+		return re_required(node->right, icase, required, nbrequired);
+	}
+
+	/* a single common byte would hand most lines to the dfa anyway */
+	re_info(node, icase, &info);
+	if (info.req[0] == '\0' ||
+	    (info.req[1] == '\0' && byte_rank(info.req[0]) > 90)) {
+		rinfo_free(&info);
+		return -1;
+	}
+
+	*required = realloc(*required, (*nbrequired + 1) * sizeof(char *));
+	(*required)[(*nbrequired)++] = strdup(info.req);
+	rinfo_free(&info);
+	return 0;
+}
+
+static int nfa_state(nfa_t *nfa, int type, int out, int out1)
+{
+	nstate_t *state;
+
+	if (nfa->nbstates == nfa->size) {
+		nfa->size = nfa->size ? nfa->size * 2 : 64;
+		nfa->states = realloc(nfa->states, nfa->size * sizeof(nstate_t));
+	}
+
+	state = &nfa->states[nfa->nbstates];
+	memset(state, 0, sizeof(nstate_t));
+	state->type = type;
+	state->out = out;
+	state->out1 = out1;
+	state->pattern = -1;
+	return nfa->nbstates++;
+}
+
+/* states are built backwards: next is where a match of node goes on */
+static int nfa_compile(nfa_t *nfa, const rnode_t *node, int next)
+{
+	int s, body;
+
+	switch (node->type) {
+	case RE_SET:
+		s = nfa_state(nfa, NS_SET, next, -1);
+		memcpy(nfa->states[s].set, node->set, 32);
+		return s;
+	case RE_CAT:
+		return nfa_compile(nfa, node->left,
+			nfa_compile(nfa, node->right, next));
+	case RE_ALT:
+		s = nfa_compile(nfa, node->left, next);
+		body = nfa_compile(nfa, node->right, next);
+		return nfa_state(nfa, NS_SPLIT, s, body);
+	case RE_QUEST:
+		return nfa_state(nfa, NS_SPLIT,
+			nfa_compile(nfa, node->left, next), next);
+	case RE_STAR:
+		s = nfa_state(nfa, NS_SPLIT, -1, next);
+		body = nfa_compile(nfa, node->left, s);
+		nfa->states[s].out = body;
+		return s;
+	case RE_PLUS:
+		s = nfa_state(nfa, NS_SPLIT, -1, next);
+		body = nfa_compile(nfa, node->left, s);
+		nfa->states[s].out = body;
+		return body;
+	case RE_BOL:
+		return nfa_state(nfa, NS_BOL, next, -1);
+	case RE_EOL:
+		return nfa_state(nfa, NS_EOL, next, -1);
+	default:
+		return next;
+	}
+}
+
+/* compiles every pattern into a single automaton, each pattern having its
+ * own final state; fails on syntax the automaton does not handle */
+static nfa_t * regex_compile(char **patterns, unsigned int nbpatterns,
+		int icase, char ***required, unsigned int *nbrequired)
+{
+	static unsigned int	serial;
+	nfa_t			*nfa;
+	rparser_t		parser;
+	rnode_t			*root;
+	unsigned int		i;
+	int			match, start, prefilter = 1;
+
+	nfa = calloc(1, sizeof(nfa_t));
+	nfa->serial = __atomic_add_fetch(&serial, 1, __ATOMIC_SEQ_CST);
+	*required = NULL;
+	*nbrequired = 0;
+
+	for (i = 0; i < nbpatterns; i++) {
+		memset(&parser, 0, sizeof(parser));
+		parser.p = patterns[i];
+		parser.icase = icase;
+		root = re_parse_alt(&parser);
+		if (*parser.p)
+			parser.error = RE_UNSUPPORTED;
+		if (parser.error) {
+			re_free(&parser);
+			break;
+		}
+
+		if (prefilter && re_required(root, icase, required, nbrequired) < 0)
+			prefilter = 0;
+
+		match = nfa_state(nfa, NS_MATCH, -1, -1);
+		nfa->states[match].pattern = i;
+		start = nfa_compile(nfa, root, match);
+		nfa->start = i ? nfa_state(nfa, NS_SPLIT, nfa->start, start) : start;
+		re_free(&parser);
+	}
+
+	if (!prefilter || i < nbpatterns) {
+		while (*nbrequired)
+			free((*required)[--(*nbrequired)]);
+		free(*required);
+		*required = NULL;
+	}
+
+	if (i < nbpatterns) {
+		free(nfa->states);
+		free(nfa);
+		return NULL;
+	}
+	return nfa;
+}
+
+/* adds the closure of state s to dfa->work: splits are followed, so are
+ * assertions when they hold */
+static void dfa_closure(dfa_t *dfa, int s, int at_bol, int at_eol, int *nb)
+{
+	const nstate_t	*state;
+	int		top = 0;
+
+	dfa->stack[top++] = s;
+	while (top) {
+		s = dfa->stack[--top];
+		if (s < 0 || dfa->marks[s] == dfa->gen)
+			continue;
+		dfa->marks[s] = dfa->gen;
+		state = &dfa->nfa->states[s];
+
+		switch (state->type) {
+		case NS_SPLIT:
+			dfa->stack[top++] = state->out1;
+			dfa->stack[top++] = state->out;
+			break;
+		case NS_BOL:
+			if (at_bol)
+				dfa->stack[top++] = state->out;
+			break;
+		case NS_EOL:
+			if (at_eol)
+				dfa->stack[top++] = state->out;
+			else
+				dfa->work[(*nb)++] = s;
+			break;
+		default:
+			dfa->work[(*nb)++] = s;
+			break;
+		}
+	}
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* lowest pattern whose final state is in work[from, nb) */
+static int dfa_match(dfa_t *dfa, int from, int nb)
+{
+	int i, match = -1;
+	const nstate_t *state;
+
+	for (i = from; i < nb; i++) {
+		state = &dfa->nfa->states[dfa->work[i]];
+		if (state->type == NS_MATCH &&
+		    (match < 0 || state->pattern < match))
+			match = state->pattern;
+	}
+	return match;
+}
+
+static unsigned int dfa_hash(const int *set, int nb)
+{
+	unsigned int	hash = 2166136261u;
+	int		i;
+
+	for (i = 0; i < nb; i++)
+		hash = (hash ^ set[i]) * 16777619u;
+	return hash & (2 * DFA_MAX_STATES - 1);
+}
+
+/* state made of the nb first nfa states of dfa->work, -1 if full */
+static int dfa_add(dfa_t *dfa, int nb)
+{
+	unsigned int	h;
+	int		id, i, eol;
+	dstate_t	*state;
+
+	qsort(dfa->work, nb, sizeof(int), cmp_int);
+	for (h = dfa_hash(dfa->work, nb); (id = dfa->table[h]) >= 0;
+	     h = (h + 1) & (2 * DFA_MAX_STATES - 1)) {
+		state = &dfa->states[id];
+		if (state->nbset == nb &&
+		    !memcmp(state->set, dfa->work, nb * sizeof(int)))
+			return id;
+	}
+
+	if (dfa->nbstates == DFA_MAX_STATES)
+		return -1;
+
+	id = dfa->nbstates++;
+	dfa->table[h] = id;
+	state = &dfa->states[id];
+	state->set = malloc(nb * sizeof(int));
+	memcpy(state->set, dfa->work, nb * sizeof(int));
+	state->nbset = nb;
+	state->match = dfa_match(dfa, 0, nb);
+	dfa->accept[id] = state->match >= 0;
+
+	/* what the state matches if the line ends right here */
+	dfa->gen++;
+	eol = nb;
+	for (i = 0; i < nb; i++) {
+		if (dfa->nfa->states[state->set[i]].type == NS_EOL)
+			dfa_closure(dfa, dfa->nfa->states[state->set[i]].out,
+				0, 1, &eol);
+	}
+	state->eol_match = dfa_match(dfa, nb, eol);
+
+	for (i = 0; i < 256; i++)
+		dfa->trans[id * 256 + i] = -1;
+	return id;
+}
+
+static void dfa_flush(dfa_t *dfa)
+{
+	int i, nb = 0;
+
+	for (i = 0; i < dfa->nbstates; i++)
+		free(dfa->states[i].set);
+	dfa->nbstates = 0;
+	for (i = 0; i < 2 * DFA_MAX_STATES; i++)
+		dfa->table[i] = -1;
+
+	dfa->gen++;
+	dfa_closure(dfa, dfa->nfa->start, 1, 0, &nb);
+	dfa->start_bol = dfa_add(dfa, nb);
+}
+
+/* transitions hold the offset of their target in the table, or -id - 2
+ * when the target is a final state so that the scan loop stops there */
+static inline int dfa_target(dfa_t *dfa, int id)
+{
+	return dfa->accept[id] ? -id - 2 : id * 256;
+}
+
+static int dfa_step(dfa_t *dfa, int from, unsigned char c)
+{
+	const dstate_t	*state = &dfa->states[from];
+	const nstate_t	*nstate;
+	int		i, nb = 0, to, *saved;
+
+	dfa->gen++;
+	for (i = 0; i < state->nbset; i++) {
+		nstate = &dfa->nfa->states[state->set[i]];
+		if (nstate->type == NS_SET && set_has(nstate->set, c))
+			dfa_closure(dfa, nstate->out, 0, 0, &nb);
+	}
+
+	/* a match may start anywhere, but not at a line beginning */
+	for (i = 0; i < dfa->nbstart_mid; i++) {
+		if (dfa->marks[dfa->start_mid[i]] != dfa->gen) {
+			dfa->marks[dfa->start_mid[i]] = dfa->gen;
+			dfa->work[nb++] = dfa->start_mid[i];
+		}
+	}
+
+	to = dfa_add(dfa, nb);
+	if (to >= 0) {
+		dfa->trans[from * 256 + c] = dfa_target(dfa, to);
+		return to;
+	}
+
+	/* cache is full, start over from the state being entered */
+	saved = malloc(nb * sizeof(int) + sizeof(int));
+	memcpy(saved, dfa->work, nb * sizeof(int));
+	dfa_flush(dfa);
+	memcpy(dfa->work, saved, nb * sizeof(int));
+	free(saved);
+	return dfa_add(dfa, nb);
+}
+
+static dfa_t * dfa_new(const nfa_t *nfa)
+{
+	dfa_t	*dfa;
+	int	nb = 0;
+
+	dfa = calloc(1, sizeof(dfa_t));
+	dfa->nfa = nfa;
+	dfa->serial = nfa->serial;
+	dfa->states = malloc(DFA_MAX_STATES * sizeof(dstate_t));
+	dfa->accept = malloc(DFA_MAX_STATES);
+	dfa->trans = malloc(DFA_MAX_STATES * 256 * sizeof(int));
+	dfa->table = malloc(2 * DFA_MAX_STATES * sizeof(int));
+	dfa->marks = calloc(nfa->nbstates, sizeof(int));
+	dfa->stack = malloc(2 * nfa->nbstates * sizeof(int) + sizeof(int));
+	dfa->work = malloc(2 * nfa->nbstates * sizeof(int) + sizeof(int));
+
+	dfa->gen++;
+	dfa_closure(dfa, nfa->start, 0, 0, &nb);
+	dfa->start_mid = malloc(nb * sizeof(int) + sizeof(int));
+	memcpy(dfa->start_mid, dfa->work, nb * sizeof(int));
+	dfa->nbstart_mid = nb;
+
+	dfa_flush(dfa);
+	return dfa;
+}
+
+static void dfa_free(void *arg)
+{
+	dfa_t	*dfa = arg, *next;
+	int	i;
+
+	while (dfa) {
+		next = dfa->next;
+		for (i = 0; i < dfa->nbstates; i++)
+			free(dfa->states[i].set);
+		free(dfa->states);
+		free(dfa->accept);
+		free(dfa->trans);
+		free(dfa->table);
+		free(dfa->marks);
+		free(dfa->stack);
+		free(dfa->work);
+		free(dfa->start_mid);
+		free(dfa);
+		dfa = next;
+	}
+}
+
+static pthread_key_t	dfa_key;
+static pthread_once_t	dfa_once = PTHREAD_ONCE_INIT;
+
+static void dfa_key_init(void)
+{
+	pthread_key_create(&dfa_key, dfa_free);
+}
+
+/* dfas are private to the calling thread and freed when it exits */
+static dfa_t * dfa_get(const nfa_t *nfa)
+{
+	dfa_t *dfa, *first;
+
+	pthread_once(&dfa_once, dfa_key_init);
+	first = pthread_getspecific(dfa_key);
+	for (dfa = first; dfa; dfa = dfa->next) {
+		if (dfa->nfa == nfa && dfa->serial == nfa->serial)
+			return dfa;
+	}
+
+	dfa = dfa_new(nfa);
+	dfa->next = first;
+	pthread_setspecific(dfa_key, dfa);
+	return dfa;
+}
+
+/* returns a pointer in the first line of the buffer holding a match */
+static const char * dfa_scan(dfa_t *dfa, const char *buf, size_t len,
+		unsigned int *pattern)
+{
+	const unsigned char	*p = (const unsigned char *) buf;
+	const unsigned char	*end = p + len;
+	int			state, next, to;
+
+	if (len == 0)
+		return NULL;
+
+	if (dfa->accept[dfa->start_bol]) {
+		*pattern = dfa->states[dfa->start_bol].match;
+		return buf;
+	}
+
+	/* the fast path only follows known transitions to non final states */
+	state = dfa->start_bol * 256;
+	for (; p < end; p++) {
+		next = dfa->trans[state + *p];
+		if (next >= 0) {
+			state = next;
+			continue;
+		}
+
+		if (next != -1) {
+			to = -next - 2;
+		} else if (*p != '\n') {
+			to = dfa_step(dfa, state / 256, *p);
+		} else if (dfa->states[state / 256].eol_match >= 0) {
+			*pattern = dfa->states[state / 256].eol_match;
+			return (const char *) p;
+		} else {
+			to = dfa->start_bol;
+			dfa->trans[state + '\n'] = dfa_target(dfa, to);
+		}
+
+		if (dfa->accept[to]) {
+			*pattern = dfa->states[to].match;
+			if (*p != '\n')
+				return (const char *) p;
+			/* every line matches */
+			return p + 1 < end ? (const char *) p + 1 : NULL;
+		}
+		state = to * 256;
+	}
+
+	/* last line has no trailing newline */
+	if (end[-1] != '\n' && dfa->states[state / 256].eol_match >= 0) {
+		*pattern = dfa->states[state / 256].eol_match;
+		return (const char *) end - 1;
+	}
+	return NULL;
+}
+
+
+/*************************** PARSING ******************************************/
+static int is_regex_valid(search_t *cursearch)
+{
+	regex_t	*reg;
+
+	reg = malloc(sizeof(regex_t));
+	if (regcomp(reg, cursearch->pattern, REG_NEWLINE)) {
+		free(reg);
+		return 0;
+	} else {
+		cursearch->regex = reg;
+	}
+
+	return 1;
+}
+
+static const char * find_literal(const matcher_t *matcher, const char *buf,
+		size_t len, unsigned int *pattern, size_t *match_len)
+{
+	*pattern = 0;
+	*match_len = matcher->literal.len;
+	return matcher->literal.find(&matcher->literal, buf, len);
+}
+
+static const char * find_multi(const matcher_t *matcher, const char *buf,
+		size_t len, unsigned int *pattern, size_t *match_len)
+{
+	const char *hit;
+
+	hit = ac_find(&matcher->ac, buf, len, pattern);
+	if (hit)
+		*match_len = matcher->ac.lens[*pattern];
+	return hit;
+}
+
+/* the dfa only knows where a match ends, so no span is reported */
+static const char * find_dfa(const matcher_t *matcher, const char *buf,
+		size_t len, unsigned int *pattern, size_t *match_len)
+{
+	dfa_t		*dfa = dfa_get(matcher->nfa);
+	const char	*end = buf + len;
+	const char	*p = buf;
+	const char	*hit, *bol, *eol;
+	unsigned int	required;
+
+	*match_len = 0;
+	if (!matcher->prefilter)
+		return dfa_scan(dfa, buf, len, pattern);
+
+	/* only lines holding a required literal can match */
+	while (p < end) {
+		if (matcher->prefilter == 1)
+			hit = matcher->literal.find(&matcher->literal, p, end - p);
+		else
+			hit = ac_find(&matcher->ac, p, end - p, &required);
+		if (!hit)
+			return NULL;
+
+		bol = memrchr(p, '\n', hit - p);
+		bol = bol ? bol + 1 : p;
+		eol = memchr(hit, '\n', end - hit);
+		if (!eol)
+			eol = end;
+
+		hit = dfa_scan(dfa, bol, eol - bol, pattern);
+		if (hit)
+			return hit;
+		p = eol + 1;
+	}
+	return NULL;
+}
+
+/* regex is compiled with REG_NEWLINE, a match never spans several lines */
+static const char * find_regex(const matcher_t *matcher, const char *buf,
+		size_t len, unsigned int *pattern, size_t *match_len)
+{
+	regmatch_t	match;
+	const char	*hit = NULL;
+	unsigned int	i;
+
+	for (i = 0; i < matcher->nbpatterns; i++) {
+		match.rm_so = 0;
+		match.rm_eo = len;
+		if (regexec(&matcher->regex[i], buf, 1, &match, REG_STARTEND))
+			continue;
+		if (!hit || buf + match.rm_so < hit) {
+			hit = buf + match.rm_so;
+			*pattern = i;
+			*match_len = match.rm_eo - match.rm_so;
+		}
+	}
+	return hit;
+}
+
+static int matcher_init(matcher_t *matcher, char **patterns,
+		unsigned int nbpatterns, int icase, int is_regex)
+{
+	unsigned int i;
+
+	matcher->patterns = patterns;
+	matcher->nbpatterns = nbpatterns;
+
+	if (is_regex) {
+		matcher->nfa = regex_compile(patterns, nbpatterns, icase,
+			&matcher->required, &matcher->prefilter);
+		if (matcher->nfa) {
+			if (matcher->prefilter == 1)
+				literal_init(&matcher->literal,
+					matcher->required[0], icase);
+			else if (matcher->prefilter > 1)
+				ac_init(&matcher->ac, matcher->required,
+					matcher->prefilter, icase);
+			matcher->find = find_dfa;
+			return 0;
+		}
+
+		/* the libc handles what the dfa cannot */
+		matcher->regex = calloc(nbpatterns, sizeof(regex_t));
+		for (i = 0; i < nbpatterns; i++) {
+			if (regcomp(&matcher->regex[i], patterns[i],
+			    REG_EXTENDED | REG_NEWLINE | (icase ? REG_ICASE : 0)))
+				return -1;
+		}
+		matcher->find = find_regex;
+	} else if (nbpatterns > 1) {
+		ac_init(&matcher->ac, patterns, nbpatterns, icase);
+		matcher->find = find_multi;
+	} else {
+		literal_init(&matcher->literal, patterns[0], icase);
+		matcher->find = find_literal;
+	}
+
+	return 0;
+}
+
+static unsigned int count_lines(const char *begin, const char *end)
+{
+	unsigned int	count = 0;
+
+	while (begin < end && (begin = memchr(begin, '\n', end - begin))) {
+		count++;
+		begin++;
+	}
+	return count;
+}
+
+/* run the matcher on the whole buffer, only hits get their line located;
+ * all of them are counted when nblines is asked for */
+static void scan_buffer(batch_t *batch, const char *buf, size_t len,
+		const matcher_t *matcher, unsigned int *nblines)
+{
+	const char	*end = buf + len;
+	const char	*p = buf;
+	const char	*counted = buf;
+	const char	*hit, *bol, *eol, *stop = buf;
+	unsigned int	line_number = 1;
+	unsigned int	pattern = 0;
+	size_t		match_len = 0;
+
+	while (p < end) {
+		/* big files are matched a block of lines at a time, so that a
+		 * replaced search stops early */
+		if (p >= stop) {
+			if (is_cancelled())
+				break;
+			stop = NULL;
+			if ((size_t) (end - p) > SCAN_BLOCK)
+				stop = memchr(p + SCAN_BLOCK, '\n',
+					end - p - SCAN_BLOCK);
+			stop = stop ? stop + 1 : end;
+		}
+
+		hit = matcher->find(matcher, p, stop - p, &pattern, &match_len);
+		if (!hit || hit >= stop) {
+			p = stop;
+			continue;
+		}
+
+		bol = memrchr(p, '\n', hit - p);
+		bol = bol ? bol + 1 : p;
+		eol = memchr(hit, '\n', end - hit);
+		if (!eol)
+			eol = end;
+
+		line_number += count_lines(counted, bol);
+		counted = bol;
+		batch_add_line(batch, line_number, bol - buf, bol,
+			(eol > bol && eol[-1] == '\r') ? eol - bol - 1 : eol - bol,
+			hit - bol, match_len, pattern);
+		p = eol + 1;
+	}
+	if (nblines)
+		*nblines = line_number - 1 + count_lines(counted, end);
+#ifdef NGP_STATS
+	STAT_ADD(lines_scanned, line_number - 1 + count_lines(counted, end) +
+		(len && end[-1] != '\n'));
+#endif
+}
+
+/* a slice claimed by another worker is already scanned or being so; the
+ * lines are counted as well, for the ones of the next slices */
+static void scan_slice(slice_t *slice)
+{
+	split_t		*split = slice->split;
+	const char	*begin = split->buf + slice->offset;
+
+	if (__atomic_exchange_n(&slice->claimed, 1, __ATOMIC_SEQ_CST))
+		return;
+	if (!is_cancelled()) {
+		scan_buffer(&slice->batch, begin, slice->len, split->matcher,
+			&slice->nblines);
+	}
+
+	pthread_mutex_lock(&split->mutex);
+	if (--split->left == 0)
+		pthread_cond_signal(&split->done);
+	pthread_mutex_unlock(&split->mutex);
+}
+
+static void split_release(split_t *split)
+{
+	if (__atomic_sub_fetch(&split->refs, 1, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_destroy(&split->mutex);
+	pthread_cond_destroy(&split->done);
+	free(split->slices);
+	free(split);
+}
+
+/* hits of a slice, in the file batch with their final line numbers; the
+ * match of a very long line was not kept, it is looked for again */
+static void split_merge(batch_t *batch, const split_t *split,
+		const slice_t *slice, unsigned int before)
+{
+	const char	*buf = split->buf, *end = split->buf + split->len;
+	const entry_t	*entry;
+	const char	*line, *eol, *hit;
+	size_t		n, match, match_len;
+	unsigned int	i, pattern;
+
+	for (i = 0; i < slice->batch.nblines; i++) {
+		entry = &slice->batch.lines[i];
+		if (!mainsearch_attr.output) {
+			*batch_new_line(batch) = *entry;
+			batch->lines[batch->nblines - 1].line += before;
+			batch->lines[batch->nblines - 1].offset += slice->offset;
+			continue;
+		}
+
+		line = buf + slice->offset + entry->offset;
+		eol = memchr(line, '\n', end - line);
+		n = (eol ? eol : end) - line;
+		if (n && line[n - 1] == '\r')
+			n--;
+		match = entry->match;
+		match_len = entry->match_len;
+		if (!match_len) {
+			hit = split->matcher->find(split->matcher, line, n,
+				&pattern, &match_len);
+			match = hit ? (size_t) (hit - line) : 0;
+		}
+		output_hit(batch, entry->line + before, line, n, match,
+			match_len);
+	}
+}
+
+/* big files are cut in slices ending on a newline, the idle workers
+ * steal them while this one scans them in order; hits come out in file
+ * order once all are done */
+static void scan_split(batch_t *batch, const char *buf, size_t len,
+		const matcher_t *matcher)
+{
+	split_t		*split;
+	slice_t		*slice;
+	const char	*eol;
+	size_t		offset = 0;
+	unsigned int	i, before = 0;
+
+	split = calloc(1, sizeof(split_t));
+	split->buf = buf;
+	split->len = len;
+	split->matcher = matcher;
+	split->refs = 1;
+	pthread_mutex_init(&split->mutex, NULL);
+	pthread_cond_init(&split->done, NULL);
+	split->slices = calloc(len / SLICE_SIZE + 1, sizeof(slice_t));
+	while (offset < len) {
+		slice = &split->slices[split->nbslices++];
+		slice->split = split;
+		slice->offset = offset;
+		eol = NULL;
+		if (len - offset > SLICE_SIZE)
+			eol = memchr(buf + offset + SLICE_SIZE, '\n',
+				len - offset - SLICE_SIZE);
+		slice->len = (eol ? (size_t) (eol + 1 - buf) : len) - offset;
+		slice->batch.collect = 1;
+		offset += slice->len;
+	}
+	split->left = split->nbslices;
+
+	/* the last slices are the first stolen, away from this worker */
+	for (i = 1; i < split->nbslices; i++)
+		pool_push_slice(batch->worker, &split->slices[i]);
+	for (i = 0; i < split->nbslices; i++)
+		scan_slice(&split->slices[i]);
+
+	pthread_mutex_lock(&split->mutex);
+	while (split->left)
+		pthread_cond_wait(&split->done, &split->mutex);
+	pthread_mutex_unlock(&split->mutex);
+
+	for (i = 0; i < split->nbslices; i++) {
+		slice = &split->slices[i];
+		split_merge(batch, split, slice, before);
+		before += slice->nblines;
+		free(slice->batch.lines);
+	}
+	split_release(split);
+}
+
+/* a nul byte or a lot of control characters in the first block tell a
+ * binary file, text encodings such as utf-8 have neither */
+static int is_binary(const char *buf, size_t len)
+{
+	unsigned char	c;
+	size_t		i, controls = 0;
+
+	if (len > BINARY_PROBE)
+		len = BINARY_PROBE;
+	if (memchr(buf, '\0', len))
+		return 1;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		if (c < ' ' && c != '\t' && c != '\n' && c != '\r' &&
+		    c != '\f' && c != '\b' && c != '\033')
+			controls++;
+	}
+	return controls * 10 > len;
+}
+
+/* binary files are only searched on demand, with a single entry telling
+ * they match since their lines mean nothing */
+static int scan_binary(batch_t *batch, const char *buf, size_t len,
+		const matcher_t *matcher)
+{
+	static const char	note[] = "binary file matches";
+	unsigned int		pattern = 0;
+	size_t			match_len;
+
+	if (!mainsearch_attr.binary ||
+	    !matcher->find(matcher, buf, len, &pattern, &match_len))
+		return 0;
+
+	batch->keep_text = 1;
+	batch->binary = 1;
+	batch_add_line(batch, 1, 0, note, sizeof(note) - 1, 0, 0, pattern);
+	batch->keep_text = 0;
+	batch->binary = 0;
+	return 1;
+}
+
+static char * read_all(int fd, size_t *len)
+{
+	char	*buf = NULL;
+	size_t	size = 0;
+	ssize_t	ret;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 65536;
+			buf = realloc(buf, size);
+		}
+		ret = read(fd, buf + *len, size - *len);
+		if (ret > 0)
+			*len += ret;
+	} while (ret > 0 || (ret < 0 && errno == EINTR));
+
+	return buf;
+}
+
+/* parse the open file, which gets closed */
+static int parse_file(batch_t *batch, int fd, const matcher_t *matcher)
+{
+	struct stat	st;
+	char		*buf;
+	size_t		len;
+
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* pipes and the like have no size, read them up front, their hits
+	 * can't be read back later so they keep their text */
+	if (!S_ISREG(st.st_mode)) {
+		if (S_ISDIR(st.st_mode)) {
+			close(fd);
+			return -1;
+		}
+		buf = read_all(fd, &len);
+		close(fd);
+		STAT_ADD(bytes_read, len);
+		STAT_START(start);
+		if (is_binary(buf, len)) {
+			STAT_ADD(files_binary, 1);
+			scan_binary(batch, buf, len, matcher);
+		} else {
+			batch->keep_text = 1;
+			scan_buffer(batch, buf, len, matcher, NULL);
+			batch->keep_text = 0;
+		}
+		STAT_TIME(match_ns, start);
+		free(buf);
+		return 0;
+	}
+
+	len = st.st_size;
+	if (len == 0) {
+		close(fd);
+		return 0;
+	}
+
+	buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return -1;
+
+	/* only the first pages are read to skip a binary file */
+	STAT_START(start);
+	if (is_binary(buf, len)) {
+		STAT_ADD(files_binary, 1);
+		STAT_ADD(bytes_read, mainsearch_attr.binary || len < BINARY_PROBE ?
+			len : BINARY_PROBE);
+		if (mainsearch_attr.binary) {
+			madvise(buf, len, MADV_SEQUENTIAL);
+			scan_binary(batch, buf, len, matcher);
+		}
+	} else if (len >= SPLIT_MIN && pool.nbworkers > 1) {
+		STAT_ADD(bytes_read, len);
+		scan_split(batch, buf, len, matcher);
+	} else {
+		STAT_ADD(bytes_read, len);
+		madvise(buf, len, MADV_SEQUENTIAL);
+		scan_buffer(batch, buf, len, matcher, NULL);
+	}
+	STAT_TIME(match_ns, start);
+	munmap(buf, len);
+	return 0;
+}
+
+/* items are opened relative to the directory holding them, if it is still
+ * open, so that the kernel doesn't walk the whole path again */
+static int work_open(const work_t *work, int flags)
+{
+	if (work->parent)
+		return openat(work->parent->fd, work->path + work->name,
+			flags | O_CLOEXEC);
+	return open(work->path, flags | O_CLOEXEC);
+}
+
+static void filelist_add(const char *path)
+{
+	pthread_mutex_t *mutex;
+
+	synchronized(filelist.mutex) {
+		if (filelist.nbpaths == filelist.size) {
+			filelist.size = filelist.size ? filelist.size * 2 : 1024;
+			filelist.paths = realloc(filelist.paths,
+				filelist.size * sizeof(char *));
+		}
+		filelist.paths[filelist.nbpaths++] =
+			arena_strndup(&filelist.arena, path, strlen(path));
+	}
+}
+
+static void filelist_free(void)
+{
+	arena_free(&filelist.arena);
+	free(filelist.paths);
+	filelist.paths = NULL;
+	filelist.nbpaths = 0;
+	filelist.size = 0;
+	filelist.complete = 0;
+}
+
+static void lookup_file(batch_t *batch, const work_t *work)
+{
+	int fd, format;
+
+	STAT_START(start);
+	STAT_ADD(files_visited, 1);
+	if (filelist.recording)
+		filelist_add(work->path);
+	batch->path = work->path;
+	fd = work_open(work, O_RDONLY);
+	STAT_TIME(open_ns, start);
+	STAT_ADD(files_opened, fd >= 0);
+	if (mainsearch_attr.decompress && fd >= 0 &&
+	    (format = stream_format(fd)) >= 0)
+		scan_stream(batch, fd, format, work->path);
+	else
+		parse_file(batch, fd, &mainsearch.matcher);
+	mainsearch_publish(batch, work->path);
+#ifdef NGP_STATS
+	stats_latency(start);
+#endif
+}
+
+
+/*************************** ARCHIVES *****************************************/
+/* the inflating side waits for a free buffer, NULL once the worker is done
+ * with the stream */
+static char * stream_reserve(stream_t *stream)
+{
+	char *buf = NULL;
+
+	pthread_mutex_lock(&stream->mutex);
+	while (!stream->stop &&
+	       stream->filled - stream->consumed == STREAM_BUFS)
+		pthread_cond_wait(&stream->cond, &stream->mutex);
+	if (!stream->stop)
+		buf = stream->bufs[stream->filled % STREAM_BUFS];
+	pthread_mutex_unlock(&stream->mutex);
+	return buf;
+}
+
+static void stream_publish(stream_t *stream, size_t len)
+{
+	if (len == 0)
+		return;
+	pthread_mutex_lock(&stream->mutex);
+	stream->lens[stream->filled % STREAM_BUFS] = len;
+	stream->filled++;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+}
+
+/* compressed input, 0 at its end or on error */
+static ssize_t stream_input(stream_t *stream, char *buf, size_t size)
+{
+	ssize_t ret;
+
+	do {
+		ret = read(stream->fd, buf, size);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? 0 : ret;
+}
+
+static void stream_plain(stream_t *stream)
+{
+	char	*out;
+	size_t	len;
+	ssize_t	ret;
+
+	while ((out = stream_reserve(stream))) {
+		len = 0;
+		while (len < STREAM_BUF &&
+		       (ret = stream_input(stream, out + len, STREAM_BUF - len)))
+			len += ret;
+		stream_publish(stream, len);
+		if (len < STREAM_BUF)
+			break;
+	}
+}
+
+/* output left in the decoder when a buffer got full is drained before
+ * more input is read, in each of these */
+#ifdef HAVE_ZLIB
+static void stream_gzip(stream_t *stream)
+{
+	char		in[STREAM_IN];
+	char		*out;
+	z_stream	z;
+	ssize_t		n;
+	int		ret, full = 0;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 32) != Z_OK)
+		return;
+	out = stream_reserve(stream);
+	z.next_out = (Bytef *) out;
+	z.avail_out = STREAM_BUF;
+	while (out) {
+		if (z.avail_in == 0 && !full) {
+			if ((n = stream_input(stream, in, sizeof(in))) == 0)
+				break;
+			z.next_in = (Bytef *) in;
+			z.avail_in = n;
+		}
+		ret = inflate(&z, Z_NO_FLUSH);
+		/* gzip files may be made of several members */
+		if (ret == Z_STREAM_END)
+			ret = inflateReset(&z);
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			break;
+		full = z.avail_out == 0;
+		if (full) {
+			stream_publish(stream, STREAM_BUF);
+			out = stream_reserve(stream);
+			z.next_out = (Bytef *) out;
+			z.avail_out = STREAM_BUF;
+		}
+	}
+	if (out)
+		stream_publish(stream, STREAM_BUF - z.avail_out);
+	inflateEnd(&z);
+}
+#endif
+
+#ifdef HAVE_LZMA
+static void stream_xz(stream_t *stream)
+{
+	char		in[STREAM_IN];
+	char		*out;
+	lzma_stream	x = LZMA_STREAM_INIT;
+	lzma_action	action = LZMA_RUN;
+	lzma_ret	ret;
+	ssize_t		n;
+	int		full = 0;
+
+	if (lzma_stream_decoder(&x, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+		return;
+	out = stream_reserve(stream);
+	x.next_out = (uint8_t *) out;
+	x.avail_out = STREAM_BUF;
+	while (out) {
+		if (x.avail_in == 0 && !full && action == LZMA_RUN) {
+			if ((n = stream_input(stream, in, sizeof(in))) == 0) {
+				action = LZMA_FINISH;
+			} else {
+				x.next_in = (const uint8_t *) in;
+				x.avail_in = n;
+			}
+		}
+		ret = lzma_code(&x, action);
+		if (ret != LZMA_OK)
+			break;
+		full = x.avail_out == 0;
+		if (full) {
+			stream_publish(stream, STREAM_BUF);
+			out = stream_reserve(stream);
+			x.next_out = (uint8_t *) out;
+			x.avail_out = STREAM_BUF;
+		}
+	}
+	if (out)
+		stream_publish(stream, STREAM_BUF - x.avail_out);
+	lzma_end(&x);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void stream_zstd(stream_t *stream)
+{
+	char		in[STREAM_IN];
+	char		*out;
+	ZSTD_DStream	*z;
+	ZSTD_inBuffer	zin = { in, 0, 0 };
+	ZSTD_outBuffer	zout;
+	size_t		ret;
+	ssize_t		n;
+	int		full = 0;
+
+	if ((z = ZSTD_createDStream()) == NULL)
+		return;
+	ZSTD_initDStream(z);
+	out = stream_reserve(stream);
+	zout.dst = out;
+	zout.size = STREAM_BUF;
+	zout.pos = 0;
+	while (out) {
+		if (zin.pos == zin.size && !full) {
+			if ((n = stream_input(stream, in, sizeof(in))) == 0)
+				break;
+			zin.size = n;
+			zin.pos = 0;
+		}
+		ret = ZSTD_decompressStream(z, &zout, &zin);
+		if (ZSTD_isError(ret))
+			break;
+		full = zout.pos == zout.size;
+		if (full) {
+			stream_publish(stream, STREAM_BUF);
+			out = stream_reserve(stream);
+			zout.dst = out;
+			zout.pos = 0;
+		}
+	}
+	if (out)
+		stream_publish(stream, zout.pos);
+	ZSTD_freeDStream(z);
+}
+#endif
+
+static void * stream_thread(void *arg)
+{
+	stream_t *stream = (stream_t *) arg;
+
+	switch (stream->format) {
+#ifdef HAVE_ZLIB
+	case FORMAT_GZIP:
+		stream_gzip(stream);
+		break;
+#endif
+#ifdef HAVE_LZMA
+	case FORMAT_XZ:
+		stream_xz(stream);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case FORMAT_ZSTD:
+		stream_zstd(stream);
+		break;
+#endif
+	default:
+		stream_plain(stream);
+		break;
+	}
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->eof = 1;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+	return (void *) NULL;
+}
+
+/* what fd holds, told by its first bytes: -1 if it is to be parsed as
+ * any file, compressed formats ngp is built without included */
+static int stream_format(int fd)
+{
+	unsigned char	magic[TAR_BLOCK];
+	ssize_t		len;
+
+	len = pread(fd, magic, sizeof(magic), 0);
+	if (len < 4)
+		return -1;
+#ifdef HAVE_ZLIB
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		return FORMAT_GZIP;
+#endif
+#ifdef HAVE_LZMA
+	if (len >= 6 && !memcmp(magic, "\xfd" "7zXZ\0", 6))
+		return FORMAT_XZ;
+#endif
+#ifdef HAVE_ZSTD
+	if (!memcmp(magic, "\x28\xb5\x2f\xfd", 4))
+		return FORMAT_ZSTD;
+#endif
+	if (len == TAR_BLOCK && !memcmp(magic + 257, "ustar", 5))
+		return FORMAT_PLAIN;
+	return -1;
+}
+
+static int stream_open(stream_t *stream, int fd, int format)
+{
+	int i;
+
+	memset(stream, 0, sizeof(stream_t));
+	stream->fd = fd;
+	stream->format = format;
+	pthread_mutex_init(&stream->mutex, NULL);
+	pthread_cond_init(&stream->cond, NULL);
+	for (i = 0; i < STREAM_BUFS; i++)
+		stream->bufs[i] = malloc(STREAM_BUF);
+	if (pthread_create(&stream->thread, NULL, &stream_thread, stream)) {
+		for (i = 0; i < STREAM_BUFS; i++)
+			free(stream->bufs[i]);
+		return -1;
+	}
+	return 0;
+}
+
+/* the inflating thread is stopped if the worker is done first */
+static void stream_close(stream_t *stream)
+{
+	int i;
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->stop = 1;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+	pthread_join(stream->thread, NULL);
+
+	for (i = 0; i < STREAM_BUFS; i++)
+		free(stream->bufs[i]);
+	pthread_mutex_destroy(&stream->mutex);
+	pthread_cond_destroy(&stream->cond);
+	close(stream->fd);
+}
+
+/* next bytes of the stream, up to max of them, 0 at its end: they stay
+ * valid until the next call */
+static size_t stream_take(stream_t *stream, uint64_t max, const char **data)
+{
+	size_t n;
+
+	if (!stream->avail) {
+		pthread_mutex_lock(&stream->mutex);
+		if (stream->holding) {
+			stream->consumed++;
+			stream->holding = 0;
+			pthread_cond_signal(&stream->cond);
+		}
+		while (stream->consumed == stream->filled && !stream->eof)
+			pthread_cond_wait(&stream->cond, &stream->mutex);
+		if (stream->consumed != stream->filled) {
+			stream->data = stream->bufs[stream->consumed % STREAM_BUFS];
+			stream->avail = stream->lens[stream->consumed % STREAM_BUFS];
+			stream->holding = 1;
+		}
+		pthread_mutex_unlock(&stream->mutex);
+		if (!stream->avail)
+			return 0;
+	}
+
+	n = max < stream->avail ? max : stream->avail;
+	*data = stream->data;
+	stream->data += n;
+	stream->avail -= n;
+	return n;
+}
+
+static size_t stream_read(stream_t *stream, char *buf, size_t len)
+{
+	const char	*data;
+	size_t		done = 0, n;
+
+	while (done < len && (n = stream_take(stream, len - done, &data))) {
+		memcpy(buf + done, data, n);
+		done += n;
+	}
+	return done;
+}
+
+static void stream_skip(stream_t *stream, uint64_t len)
+{
+	const char	*data;
+	size_t		n;
+
+	while (len && (n = stream_take(stream, len, &data)))
+		len -= n;
+}
+
+static void feed_carry(feed_t *feed, const char *data, size_t len)
+{
+	if (feed->carrylen + len > feed->carrysize) {
+		feed->carrysize = (feed->carrylen + len) * 2;
+		feed->carry = realloc(feed->carry, feed->carrysize);
+	}
+	memcpy(feed->carry + feed->carrylen, data, len);
+	feed->carrylen += len;
+}
+
+static void feed_scan(feed_t *feed, const char *buf, size_t len)
+{
+	unsigned int nblines;
+
+	feed->batch->line_base = feed->lines;
+	scan_buffer(feed->batch, buf, len, &mainsearch.matcher, &nblines);
+	feed->lines += nblines;
+}
+
+/* whole lines are scanned where they are, only the one cut by the end of
+ * the data is copied, along with its beginning if it was cut before */
+static void feed_data(feed_t *feed, const char *data, size_t len)
+{
+	const char	*first, *last;
+	size_t		n;
+
+	last = memrchr(data, '\n', len);
+	if (!last) {
+		feed_carry(feed, data, len);
+		return;
+	}
+	if (feed->carrylen) {
+		first = memchr(data, '\n', len);
+		n = first + 1 - data;
+		feed_carry(feed, data, n);
+		feed_scan(feed, feed->carry, feed->carrylen);
+		feed->carrylen = 0;
+		data += n;
+		len -= n;
+	}
+	feed_scan(feed, data, last + 1 - data);
+	feed_carry(feed, last + 1, data + len - (last + 1));
+}
+
+/* binary data is searched where it is, a match cut by the end of the
+ * previous data is looked for around the cut, from the newline before it
+ * to the one after, at most STREAM_IN bytes on each side */
+static int feed_binary(feed_t *feed, const char *data, size_t len)
+{
+	const char	*p;
+	size_t		n;
+	int		matched;
+
+	if (feed->carrylen) {
+		p = memchr(data, '\n', len);
+		n = p ? (size_t) (p + 1 - data) : len;
+		feed_carry(feed, data, n < STREAM_IN ? n : STREAM_IN);
+		matched = scan_binary(feed->batch, feed->carry, feed->carrylen,
+			&mainsearch.matcher);
+		feed->carrylen = 0;
+		if (matched)
+			return 1;
+	}
+	if (scan_binary(feed->batch, data, len, &mainsearch.matcher))
+		return 1;
+
+	p = memrchr(data, '\n', len);
+	n = data + len - (p ? p + 1 : data);
+	if (n > STREAM_IN)
+		n = STREAM_IN;
+	feed_carry(feed, data + len - n, n);
+	return 0;
+}
+
+/* scan the next len bytes of the stream, the ones already read in head
+ * first; a binary file is only searched with -b, and left as soon as it
+ * matches. Hits keep their text, the file can't be read back */
+static void scan_lines(batch_t *batch, stream_t *stream, const char *head,
+		size_t headlen, uint64_t len)
+{
+	const char	*data = head;
+	size_t		n = headlen;
+	feed_t		feed;
+	int		binary = -1, matched = 0;
+
+	memset(&feed, 0, sizeof(feed));
+	feed.batch = batch;
+	while (!is_cancelled()) {
+		if (n == 0 && (!len || !(n = stream_take(stream, len, &data))))
+			break;
+		if (data != head)
+			len -= n;
+
+		if (binary < 0)
+			binary = is_binary(data, n);
+		if (!binary) {
+			batch->keep_text = 1;
+			feed_data(&feed, data, n);
+			batch->keep_text = 0;
+		} else if (mainsearch_attr.binary && !matched) {
+			matched = feed_binary(&feed, data, n);
+		} else if (len == UINT64_MAX) {
+			break;
+		}
+		n = 0;
+	}
+
+	if (!binary && feed.carrylen) {
+		batch->keep_text = 1;
+		feed_scan(&feed, feed.carry, feed.carrylen);
+		batch->keep_text = 0;
+	}
+	batch->line_base = 0;
+	free(feed.carry);
+}
+
+/* sizes are octal, or base 256 past 8GB */
+static uint64_t tar_number(const char *field, size_t len)
+{
+	uint64_t	n = 0;
+	size_t		i = 0;
+
+	if ((unsigned char) field[0] & 0x80) {
+		n = field[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			n = n << 8 | (unsigned char) field[i];
+		return n;
+	}
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		n = n * 8 + field[i] - '0';
+	return n;
+}
+
+/* names longer than the header holds come in a gnu 'L' entry, or as the
+ * path record of a pax 'x' one, before the header they are for; 0 when
+ * there is none in it */
+static int tar_long_name(stream_t *stream, char type, uint64_t size,
+		char *name, size_t namesize)
+{
+	char	*buf, *record, *end, *value;
+	size_t	len = size < (1 << 20) ? size : (1 << 20);
+	int	found = type == 'L';
+
+	buf = malloc(len + 1);
+	len = stream_read(stream, buf, len);
+	stream_skip(stream, size - len);
+	buf[len] = '\0';
+
+	if (type == 'L') {
+		snprintf(name, namesize, "%s", buf);
+	} else {
+		/* records are "length key=value\n" */
+		for (record = buf; record < buf + len; record = end) {
+			end = record + strtoul(record, &value, 10);
+			if (end <= record || end > buf + len)
+				break;
+			if (!strncmp(value, " path=", 6)) {
+				end[-1] = '\0';
+				snprintf(name, namesize, "%s", value + 6);
+				found = 1;
+			}
+		}
+	}
+	free(buf);
+	return found;
+}
+
+/* members of a tar archive are searched one after the other, as files
+ * named archive!member */
+static void scan_tar(batch_t *batch, stream_t *stream, const char *archive,
+		char *header)
+{
+	char		name[PATH_MAX], path[PATH_MAX];
+	const char	*saved = batch->path;
+	const char	*prefix;
+	uint64_t	size;
+	int		has_name = 0;
+	char		type;
+
+	do {
+		/* the archive ends with blocks of zeroes */
+		if (header[0] == '\0')
+			break;
+		size = tar_number(header + 124, 12);
+		type = header[156];
+
+		if (type == 'L' || type == 'x') {
+			has_name |= tar_long_name(stream, type, size, name,
+				sizeof(name));
+		} else {
+			/* old gnu headers keep times where ustar has a
+			 * prefix */
+			if (!has_name) {
+				prefix = "";
+				if (!memcmp(header + 257, "ustar\0", 6))
+					prefix = header + 345;
+				snprintf(name, sizeof(name), "%.155s%s%.100s",
+					prefix, *prefix ? "/" : "", header);
+			}
+			has_name = 0;
+
+			/* members whose path does not fit are skipped */
+			if ((type == '0' || type == '\0' || type == '7') &&
+			    is_name_selected(NULL, name) &&
+			    snprintf(path, sizeof(path), "%s!%s", archive,
+			    name) < (int) sizeof(path)) {
+				batch->path = path;
+				scan_lines(batch, stream, NULL, 0, size);
+				mainsearch_publish(batch, path);
+				batch->path = saved;
+			} else {
+				stream_skip(stream, size);
+			}
+		}
+		stream_skip(stream, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+	} while (!is_cancelled() &&
+		 stream_read(stream, header, TAR_BLOCK) == TAR_BLOCK);
+}
+
+/* fd is read and inflated by another thread while this one scans what it
+ * gets, which is a tar archive or a single file */
+static int scan_stream(batch_t *batch, int fd, int format, const char *path)
+{
+	stream_t	stream;
+	char		header[TAR_BLOCK];
+	size_t		len;
+
+	if (stream_open(&stream, fd, format) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	len = stream_read(&stream, header, TAR_BLOCK);
+	if (len == TAR_BLOCK && !memcmp(header + 257, "ustar", 5))
+		scan_tar(batch, &stream, path, header);
+	else
+		scan_lines(batch, &stream, header, len,
+			len < TAR_BLOCK ? 0 : UINT64_MAX);
+	stream_close(&stream);
+	return 0;
+}
+
+
+/*************************** WORKERS ******************************************/
+static void deque_init(deque_t *deque)
+{
+	pthread_mutex_init(&deque->mutex, NULL);
+	deque->size = 64;
+	deque->head = 0;
+	deque->tail = 0;
+	deque->items = malloc(deque->size * sizeof(work_t *));
+}
+
+/* room for one more item, the lock being held */
+static void deque_reserve(deque_t *deque)
+{
+	unsigned int	i, count;
+	work_t		**items;
+
+	count = deque->tail - deque->head;
+	if (count < deque->size)
+		return;
+	items = malloc(2 * deque->size * sizeof(work_t *));
+	for (i = 0; i < count; i++)
+		items[i] = deque->items[(deque->head + i) & (deque->size - 1)];
+	free(deque->items);
+	deque->items = items;
+	deque->head = 0;
+	deque->tail = count;
+	deque->size *= 2;
+}
+
+static void deque_push(deque_t *deque, work_t *work)
+{
+	pthread_mutex_lock(&deque->mutex);
+	deque_reserve(deque);
+	deque->items[deque->tail++ & (deque->size - 1)] = work;
+	pthread_mutex_unlock(&deque->mutex);
+}
+
+/* thieves take it first: slices of a file are waited for by its owner */
+static void deque_push_head(deque_t *deque, work_t *work)
+{
+	pthread_mutex_lock(&deque->mutex);
+	deque_reserve(deque);
+	deque->items[--deque->head & (deque->size - 1)] = work;
+	pthread_mutex_unlock(&deque->mutex);
+}
+
+/* owner side: newest item first, keeps the walk depth first and cache warm */
+static work_t * deque_pop(deque_t *deque)
+{
+	work_t *work = NULL;
+
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->tail != deque->head)
+		work = deque->items[--deque->tail & (deque->size - 1)];
+	pthread_mutex_unlock(&deque->mutex);
+	return work;
+}
+
+/* thief side: oldest item first, those are the biggest subtrees; a busy
+ * deque is only waited for when block is set */
+static work_t * deque_steal(deque_t *deque, int block)
+{
+	work_t *work = NULL;
+
+	if (block)
+		pthread_mutex_lock(&deque->mutex);
+	else if (pthread_mutex_trylock(&deque->mutex))
+		return NULL;
+	if (deque->tail != deque->head)
+		work = deque->items[deque->head++ & (deque->size - 1)];
+	pthread_mutex_unlock(&deque->mutex);
+	return work;
+}
+
+/* an item is in a deque, an idle worker may take it */
+static void pool_queued(void)
+{
+	__atomic_add_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool.nbidle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool.idle_mutex);
+		pthread_cond_signal(&pool.idle_cond);
+		pthread_mutex_unlock(&pool.idle_mutex);
+	}
+}
+
+static work_t * work_new(dirhandle_t *parent, ignore_t *ignore,
+		const char *dir, const char *name, int isdir)
+{
+	work_t	*work;
+	size_t	dirlen = dir ? strlen(dir) + 1 : 0;
+	size_t	len = strlen(name) + 1;
+
+	work = malloc(sizeof(work_t) + dirlen + len);
+	if (dir) {
+		memcpy(work->path, dir, dirlen - 1);
+		work->path[dirlen - 1] = '/';
+	}
+	memcpy(work->path + dirlen, name, len);
+	work->name = dirlen;
+	work->isdir = isdir;
+	work->slice = NULL;
+	work->indexed = NULL;
+	work->parent = parent;
+	if (parent)
+		__atomic_add_fetch(&parent->refs, 1, __ATOMIC_SEQ_CST);
+	work->ignore = ignore;
+	if (ignore)
+		__atomic_add_fetch(&ignore->refs, 1, __ATOMIC_SEQ_CST);
+	return work;
+}
+
+static void pool_queue(int worker, work_t *work)
+{
+	__atomic_add_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+	deque_push(&pool.deques[worker], work);
+	pool_queued();
+}
+
+static void pool_push(int worker, dirhandle_t *parent, ignore_t *ignore,
+		const char *dir, const char *name, int isdir)
+{
+	pool_queue(worker, work_new(parent, ignore, dir, name, isdir));
+}
+
+static void pool_push_slice(int worker, slice_t *slice)
+{
+	work_t *work;
+
+	work = calloc(1, sizeof(work_t) + 1);
+	work->slice = slice;
+	__atomic_add_fetch(&slice->split->refs, 1, __ATOMIC_SEQ_CST);
+
+	__atomic_add_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+	deque_push_head(&pool.deques[worker], work);
+	pool_queued();
+}
+
+static work_t * pool_get(int worker)
+{
+	work_t	*work;
+	int	i, victim;
+
+	/* a round without waiting on busy deques, then one waiting on them
+	 * rather than spinning while items are queued */
+	work = deque_pop(&pool.deques[worker]);
+	for (i = 1; !work && i < pool.nbworkers; i++) {
+		victim = (worker + i) % pool.nbworkers;
+		work = deque_steal(&pool.deques[victim], 0);
+	}
+	if (!work && __atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST)) {
+		for (i = 1; !work && i < pool.nbworkers; i++) {
+			victim = (worker + i) % pool.nbworkers;
+			work = deque_steal(&pool.deques[victim], 1);
+		}
+	}
+
+	if (work)
+		__atomic_sub_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+	return work;
+}
+
+static void pool_done(void)
+{
+	if (__atomic_sub_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&pool.idle_mutex);
+		pthread_cond_broadcast(&pool.idle_cond);
+		pthread_mutex_unlock(&pool.idle_mutex);
+	}
+}
+
+static void dirhandle_release(dirhandle_t *dir)
+{
+	if (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+		close(dir->fd);
+		free(dir);
+		__atomic_sub_fetch(&pool.nbhandles, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/* d_type is trusted, only filesystems which don't fill it in cost a stat;
+ * symlinks are only followed to files, and only with -f */
+static unsigned char entry_type(int dirfd, const struct dirent64 *ep)
+{
+	struct stat st;
+
+	if (ep->d_type == DT_LNK)
+		return mainsearch_attr.follow_symlinks ? DT_REG : DT_LNK;
+	if (ep->d_type != DT_UNKNOWN)
+		return ep->d_type;
+
+	if (fstatat(dirfd, ep->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return DT_UNKNOWN;
+	if (S_ISLNK(st.st_mode))
+		return mainsearch_attr.follow_symlinks ? DT_REG : DT_LNK;
+	if (S_ISDIR(st.st_mode))
+		return DT_DIR;
+	return S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+}
+
+/* the whole directory is read before anything is pushed, its ignore
+ * files have to be known first */
+static void lookup_directory(int worker, batch_t *batch, work_t *work)
+{
+	char			stack[DIRENT_BUF], path[PATH_MAX];
+	char			*buf = stack;
+	const struct dirent64	*ep;
+	dirhandle_t		*dir = NULL;
+	ignore_t		*ignore = work->ignore;
+	const char		*rel;
+	unsigned char		type;
+	size_t			size = sizeof(stack), total = 0;
+	ssize_t			len, pos;
+	unsigned int		i;
+	int			fd, has_ignore = 0;
+
+	fd = work_open(work, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		/* the root may well be a file */
+		if (errno == ENOTDIR && !work->parent && work->name == 0)
+			pool.visit(batch, work);
+		return;
+	}
+	STAT_ADD(dirs, 1);
+	if (pool.visit_dir)
+		pool.visit_dir(work, fd);
+	rel = strlen(work->path) >= pool.prefix ? work->path + pool.prefix : "";
+
+	/* past a point entries are opened with their path, rather than
+	 * keeping more directories open */
+	if (__atomic_add_fetch(&pool.nbhandles, 1, __ATOMIC_SEQ_CST)
+	    <= DIR_HANDLES) {
+		dir = malloc(sizeof(dirhandle_t));
+		dir->fd = fd;
+		dir->refs = 1;
+	} else {
+		__atomic_sub_fetch(&pool.nbhandles, 1, __ATOMIC_SEQ_CST);
+	}
+
+	while ((len = getdents64(fd, buf + total, size - total)) > 0) {
+		total += len;
+		if (size - total >= sizeof(stack) / 2)
+			continue;
+		size *= 2;
+		if (buf == stack) {
+			buf = malloc(size);
+			memcpy(buf, stack, total);
+		} else {
+			buf = realloc(buf, size);
+		}
+	}
+
+	for (pos = 0; ignore && pos < (ssize_t) total; pos += ep->d_reclen) {
+		ep = (const struct dirent64 *) (buf + pos);
+		for (i = 0; ep->d_name[0] == '.' &&
+		     i < sizeof(ignore_files) / sizeof(char *); i++)
+			has_ignore |= !strcmp(ep->d_name, ignore_files[i]);
+	}
+	if (has_ignore)
+		ignore = ignore_enter(ignore, fd, rel);
+
+	for (pos = 0; pos < (ssize_t) total && !is_cancelled();
+	     pos += ep->d_reclen) {
+		ep = (const struct dirent64 *) (buf + pos);
+		type = entry_type(fd, ep);
+		if (type != DT_DIR && type != DT_REG)
+			continue;
+		if (ignore) {
+			snprintf(path, sizeof(path), "%s%s%s", rel,
+				*rel ? "/" : "", ep->d_name);
+			if (is_ignored(ignore, path, ep->d_name,
+			    type == DT_DIR)) {
+				STAT_ADD(files_skipped, type == DT_REG);
+				continue;
+			}
+		}
+
+		if (type == DT_DIR) {
+			if (!is_dir_special(ep->d_name) &&
+			    !is_dir_exclude(ep->d_ino) &&
+			    is_dir_selected(rel, ep->d_name))
+				pool_push(worker, dir, ignore, work->path,
+					ep->d_name, 1);
+		} else if (is_file_selected(rel, ep->d_name, fd, ep->d_name)) {
+			pool_push(worker, dir, ignore, work->path, ep->d_name, 0);
+		} else {
+			STAT_ADD(files_skipped, 1);
+		}
+	}
+
+	if (has_ignore)
+		ignore_release(ignore);
+	if (buf != stack)
+		free(buf);
+	if (dir)
+		dirhandle_release(dir);
+	else
+		close(fd);
+}
+
+static void * worker_thread(void *arg)
+{
+	int	worker = (int) (long) arg;
+	work_t	*work;
+	batch_t	batch;
+	pthread_mutex_t *mutex;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.worker = worker;
+	while (1) {
+		work = pool_get(worker);
+		if (work) {
+			if (work->slice)
+				scan_slice(work->slice);
+			else if (is_cancelled())
+				;	/* the search is being replaced */
+			else if (work->indexed)
+				index_check(worker, &batch, work);
+			else if (work->isdir) {
+				STAT_START(start);
+				lookup_directory(worker, &batch, work);
+				STAT_TIME(walk_ns, start);
+			} else {
+				pool.visit(&batch, work);
+			}
+			dirhandle_release(work->parent);
+			ignore_release(work->ignore);
+			if (work->slice)
+				split_release(work->slice->split);
+			free(work);
+			pool_done();
+			continue;
+		}
+
+		/* nothing to pop nor to steal: sleep until something is
+		 * pushed, leave once every item has been processed */
+		pthread_mutex_lock(&pool.idle_mutex);
+		__atomic_add_fetch(&pool.nbidle, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST)
+		    && __atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&pool.idle_cond, &pool.idle_mutex);
+		__atomic_sub_fetch(&pool.nbidle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool.idle_mutex);
+
+		if (!__atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST))
+			break;
+	}
+
+	/* the strings of the hits now belong to the search */
+	synchronized(mainsearch.data_mutex)
+		arena_splice(&mainsearch.arena, &batch.arena);
+	free(batch.lines);
+	output_flush(&batch);
+	free(batch.out);
+	return (void *) NULL;
+}
+
+static void pool_init(void (*visit)(batch_t *, const work_t *))
+{
+	int i;
+
+	pool.visit = visit;
+	pool.visit_dir = NULL;
+	pool.nbworkers = mainsearch_attr.nbworkers;
+	if (pool.nbworkers < 1)
+		pool.nbworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (pool.nbworkers < 1)
+		pool.nbworkers = 1;
+
+	pool.deques = malloc(pool.nbworkers * sizeof(deque_t));
+	pool.threads = malloc(pool.nbworkers * sizeof(pthread_t));
+	for (i = 0; i < pool.nbworkers; i++)
+		deque_init(&pool.deques[i]);
+	pthread_mutex_init(&pool.idle_mutex, NULL);
+	pthread_cond_init(&pool.idle_cond, NULL);
+}
+
+static void pool_free(void)
+{
+	int i;
+
+	for (i = 0; i < pool.nbworkers; i++)
+		free(pool.deques[i].items);
+	free(pool.deques);
+	free(pool.threads);
+}
+
+/* the workers read nbworkers to pick whom to steal from, it stays as is
+ * when fewer could be started and their deques are only left empty;
+ * returns how many were */
+static int pool_start(void)
+{
+	int started;
+
+	for (started = 0; started < pool.nbworkers; started++) {
+		if (pthread_create(&pool.threads[started], NULL,
+		    &worker_thread, (void *) (long) started))
+			break;
+	}
+	return started;
+}
+
+/* wait until the workers are done with every item */
+static void pool_join(int started)
+{
+	int i;
+
+	/* no worker could be started, browse on our own */
+	if (started == 0) {
+		worker_thread((void *) 0);
+	} else {
+		for (i = 0; i < started; i++)
+			pthread_join(pool.threads[i], NULL);
+	}
+}
+
+/* process what has been pushed so far, and whatever it leads to */
+static void pool_run(void)
+{
+	pool_join(pool_start());
+}
+
+static void * lookup_thread(void *arg)
+{
+	search_t	*d = (search_t *) arg;
+	ignore_t	*ignore;
+	pthread_mutex_t	*mutex;
+	unsigned int	i;
+	int		seeded, started;
+
+	pool_init(lookup_file);
+	pool.prefix = strlen(d->directory) + 1;
+
+	/* seeding counts as an item, so that the workers started first wait
+	 * for what it pushes instead of leaving, and parse it as it comes */
+	__atomic_add_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+	started = pool_start();
+
+	/* the index tells which files are worth a look, if there is one,
+	 * otherwise the files of the last walk are, if there was one */
+	seeded = index_seed(d->directory) == 0;
+	if (!seeded && filelist.complete) {
+		for (i = 0; i < filelist.nbpaths && !is_cancelled(); i++)
+			pool_push(i % pool.nbworkers, NULL, NULL, NULL,
+				filelist.paths[i], 0);
+	} else if (!seeded) {
+		filelist_free();
+		filelist.recording = !mainsearch_attr.output;
+		ignore = ignore_global(d->directory);
+		pool_push(0, NULL, ignore, NULL, d->directory, 1);
+		ignore_release(ignore);
+	}
+	pool_done();
+	pool_join(started);
+	index_unseed();
+	pool_free();
+	if (filelist.recording && !is_cancelled())
+		filelist.complete = 1;
+	filelist.recording = 0;
+
+	synchronized(mainsearch.data_mutex) {
+		d->status = 0;
+		pthread_cond_broadcast(&d->grown);
+	}
+	ui_wake();
+	return (void *) NULL;
+}
+
+
+/*************************** INDEX ********************************************/
+static index_build_t	builder;
+static index_seed_t	seed;
+static pthread_key_t	trigrams_key;
+static pthread_once_t	trigrams_once = PTHREAD_ONCE_INIT;
+
+static void trigrams_free(void *arg)
+{
+	trigrams_t *trigrams = arg;
+
+	free(trigrams->seen);
+	free(trigrams->list);
+	free(trigrams);
+}
+
+static void trigrams_key_init(void)
+{
+	pthread_key_create(&trigrams_key, trigrams_free);
+}
+
+/* each worker keeps a bitmap of all the trigrams to spot duplicates */
+static trigrams_t * trigrams_get(void)
+{
+	trigrams_t *trigrams;
+
+	pthread_once(&trigrams_once, trigrams_key_init);
+	trigrams = pthread_getspecific(trigrams_key);
+	if (!trigrams) {
+		trigrams = calloc(1, sizeof(trigrams_t));
+		trigrams->seen = calloc((1 << 24) / 64, sizeof(uint64_t));
+		pthread_setspecific(trigrams_key, trigrams);
+	}
+	return trigrams;
+}
+
+/* trigrams are made of folded bytes so that they serve -i searches as
+ * well, and never span lines since no pattern does */
+static void trigrams_collect(trigrams_t *trigrams, const char *buf,
+		size_t len)
+{
+	uint32_t	trigram = 0;
+	size_t		i, valid = 0;
+
+	trigrams->nblist = 0;
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\n') {
+			valid = 0;
+			continue;
+		}
+
+		trigram = ((trigram << 8) | fold(buf[i])) & 0xffffff;
+		if (++valid < 3 ||
+		    trigrams->seen[trigram / 64] & (1ULL << (trigram % 64)))
+			continue;
+
+		trigrams->seen[trigram / 64] |= 1ULL << (trigram % 64);
+		if (trigrams->nblist == trigrams->size) {
+			trigrams->size = trigrams->size ? trigrams->size * 2 : 4096;
+			trigrams->list = realloc(trigrams->list,
+				trigrams->size * sizeof(uint32_t));
+		}
+		trigrams->list[trigrams->nblist++] = trigram;
+	}
+
+	for (i = 0; i < trigrams->nblist; i++)
+		trigrams->seen[trigrams->list[i] / 64] = 0;
+}
+
+static inline uint32_t trigram_hash(uint32_t trigram, uint32_t size)
+{
+	return (trigram * 2654435761U) & (size - 1);
+}
+
+static posting_t * builder_posting(uint32_t trigram)
+{
+	posting_t	*old;
+	uint32_t	i, j, size;
+
+	if (2 * (builder.nbpostings + 1) > builder.size) {
+		old = builder.postings;
+		size = builder.size;
+		builder.size = size ? size * 2 : 65536;
+		builder.postings = calloc(builder.size, sizeof(posting_t));
+		for (i = 0; i < size; i++) {
+			if (!old[i].buf)
+				continue;
+			j = trigram_hash(old[i].trigram, builder.size);
+			while (builder.postings[j].buf)
+				j = (j + 1) & (builder.size - 1);
+			builder.postings[j] = old[i];
+		}
+		free(old);
+	}
+
+	i = trigram_hash(trigram, builder.size);
+	while (builder.postings[i].buf) {
+		if (builder.postings[i].trigram == trigram)
+			return &builder.postings[i];
+		i = (i + 1) & (builder.size - 1);
+	}
+
+	builder.postings[i].trigram = trigram;
+	builder.postings[i].size = 16;
+	builder.postings[i].buf = malloc(16);
+	builder.nbpostings++;
+	return &builder.postings[i];
+}
+
+/* ids are handed out in order, only the gap to the previous one is kept */
+static void posting_add(posting_t *posting, uint32_t id)
+{
+	uint32_t delta = posting->count ? id - posting->last : id;
+
+	if (posting->len + 5 > posting->size) {
+		posting->size *= 2;
+		posting->buf = realloc(posting->buf, posting->size);
+	}
+	while (delta >= 0x80) {
+		posting->buf[posting->len++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	posting->buf[posting->len++] = delta;
+	posting->last = id;
+	posting->count++;
+}
+
+static inline uint32_t posting_next(const unsigned char **p)
+{
+	uint32_t	value = 0;
+	int		shift = 0;
+
+	do {
+		value |= (uint32_t) (**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+	return value;
+}
+
+static void manifest_stat(index_file_t *file, const struct stat *st,
+		uint32_t flags)
+{
+	memset(file, 0, sizeof(index_file_t));
+	file->flags = flags;
+	file->ino = st->st_ino;
+	file->size = st->st_size;
+	file->mtime = st->st_mtim.tv_sec;
+	file->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int manifest_changed(const index_file_t *file, const struct stat *st)
+{
+	return file->ino != (uint64_t) st->st_ino ||
+		file->size != (uint64_t) st->st_size ||
+		file->mtime != st->st_mtim.tv_sec ||
+		file->mtime_nsec != (uint32_t) st->st_mtim.tv_nsec;
+}
+
+/* slot of the path, an empty one if it is unknown */
+static manifest_slot_t * manifest_find(const manifest_t *manifest,
+		const char *path)
+{
+	uint32_t i;
+
+	i = path_hash(path) & (manifest->size - 1);
+	while (manifest->slots[i].path && strcmp(manifest->slots[i].path, path))
+		i = (i + 1) & (manifest->size - 1);
+	return &manifest->slots[i];
+}
+
+/* newer segments are read first, so that their entries win */
+static void manifest_init(manifest_t *manifest, const index_t *segments,
+		unsigned int nbsegments)
+{
+	manifest_slot_t	*slot;
+	const char	*path;
+	uint32_t	total = 0, id;
+	int		i;
+
+	for (i = 0; i < (int) nbsegments; i++)
+		total += segments[i].header->nbfiles;
+	for (manifest->size = 1024; manifest->size < 2 * total; )
+		manifest->size *= 2;
+	manifest->slots = calloc(manifest->size, sizeof(manifest_slot_t));
+
+	for (i = nbsegments - 1; i >= 0; i--) {
+		for (id = 0; id < segments[i].header->nbfiles; id++) {
+			path = segments[i].paths + segments[i].files[id].path;
+			slot = manifest_find(manifest, path);
+			if (slot->path)
+				continue;
+			slot->path = path;
+			slot->segment = i;
+			slot->id = id;
+		}
+	}
+}
+
+/* entry of the path in the index, NULL if it is unknown or deleted */
+static const index_file_t * manifest_get(const manifest_t *manifest,
+		const index_t *segments, const char *path, manifest_slot_t **slot)
+{
+	const index_file_t *file;
+
+	*slot = manifest_find(manifest, path);
+	if (!(*slot)->path)
+		return NULL;
+	file = &segments[(*slot)->segment].files[(*slot)->id];
+	return (file->flags & INDEX_DELETED) ? NULL : file;
+}
+
+static int manifest_is_live(const manifest_t *manifest,
+		const index_t *segments, unsigned int segment, uint32_t id)
+{
+	const char	*path;
+	manifest_slot_t	*slot;
+
+	if (segments[segment].files[id].flags & INDEX_DELETED)
+		return 0;
+	path = segments[segment].paths + segments[segment].files[id].path;
+	slot = manifest_find(manifest, path);
+	return slot->segment == segment && slot->id == id;
+}
+
+/* append an entry to the file table, the caller holds builder.mutex */
+static uint32_t builder_file(const char *path, const index_file_t *file)
+{
+	size_t		len = strlen(path) + 1;
+	uint32_t	id;
+
+	if (builder.nbfiles == builder.files_size) {
+		builder.files_size = builder.files_size ?
+			builder.files_size * 2 : 1024;
+		builder.files = realloc(builder.files,
+			builder.files_size * sizeof(index_file_t));
+	}
+	while (builder.paths_len + len > builder.paths_size) {
+		builder.paths_size = builder.paths_size ?
+			builder.paths_size * 2 : 65536;
+		builder.paths = realloc(builder.paths, builder.paths_size);
+	}
+
+	id = builder.nbfiles++;
+	builder.files[id] = *file;
+	builder.files[id].path = builder.paths_len;
+	memcpy(builder.paths + builder.paths_len, path, len);
+	builder.paths_len += len;
+	return id;
+}
+
+static const char * builder_relative(const char *path)
+{
+	return strlen(path) >= builder.prefix ? path + builder.prefix : "";
+}
+
+/* an entry which did not change since it was indexed is kept as is */
+static int builder_is_known(const char *path, const struct stat *st)
+{
+	const index_file_t	*file;
+	manifest_slot_t		*slot;
+
+	if (!builder.nbsegments)
+		return 0;
+
+	file = manifest_get(&builder.manifest, builder.segments,
+		builder_relative(path), &slot);
+	if (!file)
+		return 0;
+
+	if (manifest_changed(file, st)) {
+		builder.visited[slot->segment][slot->id] = 1;
+		return 0;
+	}
+	builder.visited[slot->segment][slot->id] = 2;
+	return 1;
+}
+
+static void builder_add(const char *file, const struct stat *st,
+		const trigrams_t *trigrams, uint32_t flags)
+{
+	pthread_mutex_t	*mutex;
+	index_file_t	entry;
+	uint32_t	id;
+	size_t		i;
+
+	manifest_stat(&entry, st, flags);
+	synchronized(builder.mutex) {
+		id = builder_file(builder_relative(file), &entry);
+		if (!(flags & INDEX_DIR))
+			builder.nbchanged++;
+		for (i = 0; trigrams && i < trigrams->nblist; i++)
+			posting_add(builder_posting(trigrams->list[i]), id);
+	}
+}
+
+/* directories are listed too, their mtime tells whether they got new
+ * entries since they were indexed */
+static void index_dir(const work_t *work, int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || builder_is_known(work->path, &st))
+		return;
+	builder_add(work->path, &st, NULL, INDEX_DIR);
+}
+
+/* visitor of the pool while indexing: binary files are listed without any
+ * trigram, since they can only be searched with -b */
+static void index_file(batch_t *batch, const work_t *work)
+{
+	const char	*file = work->path;
+	trigrams_t	*trigrams;
+	struct stat	st;
+	char		*buf;
+	int		fd;
+
+	S_VAR_NOT_USED(batch);
+	if (!strncmp(file + work->name, INDEX_NAME, strlen(INDEX_NAME)))
+		return;
+
+	fd = work_open(work, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    builder_is_known(file, &st)) {
+		close(fd);
+		return;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		builder_add(file, &st, NULL, 0);
+		return;
+	}
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return;
+
+	if (is_binary(buf, st.st_size)) {
+		builder_add(file, &st, NULL, INDEX_BINARY);
+	} else {
+		madvise(buf, st.st_size, MADV_SEQUENTIAL);
+		trigrams = trigrams_get();
+		trigrams_collect(trigrams, buf, st.st_size);
+		builder_add(file, &st, trigrams, 0);
+	}
+	munmap(buf, st.st_size);
+}
+
+/* -1 when the path does not fit */
+static int index_path(char *path, size_t size, const char *dir,
+		unsigned int segment)
+{
+	int len;
+
+	if (segment == 0)
+		len = snprintf(path, size, "%s/%s", dir, INDEX_NAME);
+	else
+		len = snprintf(path, size, "%s/%s.%u", dir, INDEX_NAME, segment);
+	return len < (int) size ? 0 : -1;
+}
+
+/* an index only serves searches which would have browsed the same files */
+static uint32_t index_flags(void)
+{
+	return (mainsearch_attr.follow_symlinks ? INDEX_SYMLINKS : 0) |
+		(mainsearch_attr.no_ignore ? INDEX_NOIGNORE : 0);
+}
+
+static int index_open(index_t *index, const char *path)
+{
+	struct stat	st;
+	int		fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(index_header_t)) {
+		close(fd);
+		return -1;
+	}
+
+	index->size = st.st_size;
+	index->map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (index->map == MAP_FAILED)
+		return -1;
+
+	index->header = (const index_header_t *) index->map;
+	if (memcmp(index->header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+	    index->header->size != index->size ||
+	    index->header->flags != index_flags()) {
+		munmap(index->map, index->size);
+		return -1;
+	}
+
+	index->files = (const index_file_t *) (index->map + index->header->files);
+	index->paths = index->map + index->header->paths;
+	index->trigrams = (const index_trigram_t *)
+		(index->map + index->header->trigrams);
+	index->postings = (const unsigned char *) index->map;
+	return 0;
+}
+
+/* the segments of the index of dir, none if its base is missing */
+static unsigned int index_open_all(index_t *segments, const char *dir)
+{
+	char		path[PATH_MAX];
+	unsigned int	i;
+
+	for (i = 0; i < INDEX_SEGMENTS; i++) {
+		if (index_path(path, sizeof(path), dir, i) < 0 ||
+		    index_open(&segments[i], path) < 0)
+			break;
+	}
+	return i;
+}
+
+static void index_close_all(index_t *segments, unsigned int nbsegments)
+{
+	unsigned int i;
+
+	for (i = 0; i < nbsegments; i++)
+		munmap(segments[i].map, segments[i].size);
+}
+
+static int posting_cmp(const void *a, const void *b)
+{
+	const posting_t *pa = a, *pb = b;
+
+	return (pa->trigram > pb->trigram) - (pa->trigram < pb->trigram);
+}
+
+static void index_write(const char *dir, unsigned int segment)
+{
+	char		path[PATH_MAX], tmp_path[PATH_MAX];
+	static const char	zeroes[8];
+	index_header_t	header;
+	index_trigram_t	trigram;
+	posting_t	*postings;
+	uint64_t	offset;
+	uint32_t	i, j;
+	FILE		*out;
+
+	/* pack the used slots, sorted by trigram */
+	postings = builder.postings;
+	for (i = 0, j = 0; i < builder.size; i++) {
+		if (postings[i].buf)
+			postings[j++] = postings[i];
+	}
+	qsort(postings, j, sizeof(posting_t), posting_cmp);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.flags = index_flags();
+	header.nbfiles = builder.nbfiles;
+	header.nbtrigrams = builder.nbpostings;
+	header.files = sizeof(header);
+	header.paths = header.files + builder.nbfiles * sizeof(index_file_t);
+	header.trigrams = (header.paths + builder.paths_len + 7) & ~7ULL;
+	header.postings = header.trigrams +
+		builder.nbpostings * sizeof(index_trigram_t);
+	header.size = header.postings;
+	for (i = 0; i < builder.nbpostings; i++)
+		header.size += postings[i].len;
+
+	if (index_path(path, sizeof(path), dir, segment) < 0 ||
+	    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+	    (int) sizeof(tmp_path)) {
+		fprintf(stderr, "ngp: index path too long in %s\n", dir);
+		exit(-1);
+	}
+	out = fopen(tmp_path, "w");
+	if (!out) {
+		fprintf(stderr, "ngp: cannot write %s\n", tmp_path);
+		exit(-1);
+	}
+
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(builder.files, sizeof(index_file_t), builder.nbfiles, out);
+	fwrite(builder.paths, 1, builder.paths_len, out);
+	fwrite(zeroes, 1, header.trigrams - header.paths - builder.paths_len,
+		out);
+
+	offset = header.postings;
+	for (i = 0; i < builder.nbpostings; i++) {
+		trigram.trigram = postings[i].trigram;
+		trigram.count = postings[i].count;
+		trigram.offset = offset;
+		offset += postings[i].len;
+		fwrite(&trigram, sizeof(trigram), 1, out);
+	}
+	for (i = 0; i < builder.nbpostings; i++)
+		fwrite(postings[i].buf, 1, postings[i].len, out);
+
+	if (ferror(out) | fclose(out) || rename(tmp_path, path) < 0) {
+		fprintf(stderr, "ngp: cannot write %s\n", path);
+		unlink(tmp_path);
+		exit(-1);
+	}
+
+	/* the postings are now packed at the start of the table */
+	for (i = 0; i < builder.nbpostings; i++)
+		free(postings[i].buf);
+	memset(postings, 0, builder.size * sizeof(posting_t));
+	builder.nbpostings = 0;
+}
+
+/* entries of the walk come first, the ones kept from each segment follow
+ * in order so that every posting list stays sorted */
+static void index_merge(void)
+{
+	const index_t	*segment;
+	const unsigned char *p;
+	uint32_t	*ids, i, k, id;
+	unsigned int	s;
+
+	for (s = 0; s < builder.nbsegments; s++) {
+		segment = &builder.segments[s];
+		ids = malloc(segment->header->nbfiles * sizeof(uint32_t));
+		for (i = 0; i < segment->header->nbfiles; i++) {
+			if (builder.visited[s][i] == 2 &&
+			    manifest_is_live(&builder.manifest, builder.segments, s, i))
+				ids[i] = builder_file(segment->paths +
+					segment->files[i].path, &segment->files[i]);
+			else
+				ids[i] = UINT32_MAX;
+		}
+
+		for (i = 0; i < segment->header->nbtrigrams; i++) {
+			p = segment->postings + segment->trigrams[i].offset;
+			for (k = 0, id = 0; k < segment->trigrams[i].count; k++) {
+				id = k ? id + posting_next(&p) : posting_next(&p);
+				if (ids[id] != UINT32_MAX)
+					posting_add(builder_posting(
+						segment->trigrams[i].trigram), ids[id]);
+			}
+		}
+		free(ids);
+	}
+}
+
+/* entries gone since the last update are shadowed by deleted ones */
+static uint32_t index_tombstones(void)
+{
+	const index_t	*segment;
+	index_file_t	file;
+	uint32_t	i, nb = 0;
+	unsigned int	s;
+
+	for (s = 0; s < builder.nbsegments; s++) {
+		segment = &builder.segments[s];
+		for (i = 0; i < segment->header->nbfiles; i++) {
+			if (builder.visited[s][i] ||
+			    !manifest_is_live(&builder.manifest, builder.segments, s, i))
+				continue;
+			file = segment->files[i];
+			file.flags = INDEX_DELETED | (file.flags & INDEX_DIR);
+			builder_file(segment->paths + file.path, &file);
+			nb++;
+		}
+	}
+	return nb;
+}
+
+static void index_walk(const char *dir)
+{
+	ignore_t *ignore;
+
+	if (isfile((char *) dir)) {
+		fprintf(stderr, "ngp: %s is not a directory\n", dir);
+		exit(-1);
+	}
+
+	/* every file is indexed, the selection is done at search time */
+	selector.all = 1;
+	pthread_mutex_init(&builder.mutex, NULL);
+	builder.prefix = strlen(dir) + 1;
+
+	ignore = ignore_global(dir);
+	pool_init(index_file);
+	pool.prefix = builder.prefix;
+	pool.visit_dir = index_dir;
+	pool_push(0, NULL, ignore, NULL, dir, 1);
+	ignore_release(ignore);
+	pool_run();
+	pool_free();
+}
+
+static void index_reset(void)
+{
+	unsigned int i;
+
+	index_close_all(builder.segments, builder.nbsegments);
+	for (i = 0; i < builder.nbsegments; i++)
+		free(builder.visited[i]);
+	free(builder.manifest.slots);
+	free(builder.postings);
+	free(builder.files);
+	free(builder.paths);
+	memset(&builder, 0, sizeof(builder));
+}
+
+static void index_build(const char *dir)
+{
+	char		path[PATH_MAX];
+	unsigned int	i;
+
+	index_walk(dir);
+	index_write(dir, 0);
+	for (i = 1; i < INDEX_SEGMENTS; i++) {
+		if (index_path(path, sizeof(path), dir, i) == 0)
+			unlink(path);
+	}
+	index_reset();
+}
+
+/* only what changed is indexed again, into a new segment; once there are
+ * too many of them, they are all merged back into the base */
+static void index_update(const char *dir)
+{
+	char		path[PATH_MAX];
+	unsigned int	i;
+
+	builder.nbsegments = index_open_all(builder.segments, dir);
+	if (builder.nbsegments == 0) {
+		index_build(dir);
+		return;
+	}
+
+	manifest_init(&builder.manifest, builder.segments, builder.nbsegments);
+	for (i = 0; i < builder.nbsegments; i++)
+		builder.visited[i] = calloc(builder.segments[i].header->nbfiles, 1);
+	index_walk(dir);
+
+	/* writing the index changes the mtime of dir, so directories alone
+	 * don't make a new segment: searches only list them again */
+	if (builder.nbsegments < INDEX_SEGMENTS) {
+		if (index_tombstones() + builder.nbchanged > 0)
+			index_write(dir, builder.nbsegments);
+	} else {
+		index_merge();
+		index_write(dir, 0);
+		for (i = 1; i < INDEX_SEGMENTS; i++) {
+			if (index_path(path, sizeof(path), dir, i) == 0)
+				unlink(path);
+		}
+	}
+	index_reset();
+}
+
+#ifdef __linux__
+static void watch_add(int fd, char ***dirs, int *nbdirs, const char *dir)
+{
+	char		path[PATH_MAX];
+	struct dirent	*ep;
+	DIR		*dp;
+	int		wd;
+
+	wd = inotify_add_watch(fd, dir, IN_CREATE | IN_DELETE | IN_MODIFY |
+		IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+	if (wd < 0)
+		return;
+	if (wd >= *nbdirs) {
+		*dirs = realloc(*dirs, (wd + 1) * sizeof(char *));
+		memset(*dirs + *nbdirs, 0, (wd + 1 - *nbdirs) * sizeof(char *));
+		*nbdirs = wd + 1;
+	}
+	free((*dirs)[wd]);
+	(*dirs)[wd] = strdup(dir);
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+	while ((ep = readdir(dp)) != NULL) {
+		if (ep->d_type != DT_DIR || is_dir_special(ep->d_name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, ep->d_name);
+		watch_add(fd, dirs, nbdirs, path);
+	}
+	closedir(dp);
+}
+
+/* changes come in bursts, the index is updated once things calm down */
+static void index_watch(const char *dir)
+{
+	char			buf[4096], path[PATH_MAX];
+	const struct inotify_event *event;
+	struct pollfd		pfd;
+	char			**dirs = NULL;
+	int			nbdirs = 0, dirty = 0, ret, i;
+	ssize_t			len, pos;
+
+	index_update(dir);
+
+	pfd.fd = inotify_init1(IN_CLOEXEC);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0) {
+		fprintf(stderr, "ngp: cannot watch %s\n", dir);
+		exit(-1);
+	}
+	watch_add(pfd.fd, &dirs, &nbdirs, dir);
+
+	while (1) {
+		ret = poll(&pfd, 1, dirty ? 1000 : -1);
+		if (ret < 0 && errno != EINTR)
+			break;
+		if (ret == 0) {
+			index_update(dir);
+			dirty = 0;
+			continue;
+		}
+
+		len = read(pfd.fd, buf, sizeof(buf));
+		for (pos = 0; pos < len; pos += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) (buf + pos);
+			if (event->len && !strncmp(event->name, INDEX_NAME,
+			    strlen(INDEX_NAME)))
+				continue;
+			dirty = 1;
+			if ((event->mask & IN_ISDIR) &&
+			    (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+			    event->wd < nbdirs && dirs[event->wd]) {
+				snprintf(path, sizeof(path), "%s/%s",
+					dirs[event->wd], event->name);
+				watch_add(pfd.fd, &dirs, &nbdirs, path);
+			}
+		}
+	}
+
+	for (i = 0; i < nbdirs; i++)
+		free(dirs[i]);
+	free(dirs);
+	close(pfd.fd);
+}
+#else
+static void index_watch(const char *dir)
+{
+	S_VAR_NOT_USED(dir);
+	fprintf(stderr, "ngp: watching is not supported on this system\n");
+	exit(-1);
+}
+#endif
+
+static const index_trigram_t * index_lookup(const index_t *index,
+		uint32_t trigram)
+{
+	uint32_t low = 0, high = index->header->nbtrigrams, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (index->trigrams[mid].trigram < trigram)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low < index->header->nbtrigrams &&
+	    index->trigrams[low].trigram == trigram)
+		return &index->trigrams[low];
+	return NULL;
+}
+
+static int index_trigram_cmp(const void *a, const void *b)
+{
+	const index_trigram_t *ta = *(const index_trigram_t **) a;
+	const index_trigram_t *tb = *(const index_trigram_t **) b;
+
+	return (ta->count > tb->count) - (ta->count < tb->count);
+}
+
+/* files holding every trigram of the literal, the rarest trigram goes first
+ * so that the list only shrinks; NULL when the literal is too short */
+static uint32_t * index_query(const index_t *index, const char *literal,
+		uint32_t *nbids)
+{
+	const index_trigram_t	**trigrams;
+	const unsigned char	*p;
+	uint32_t		*ids, trigram = 0, id, k;
+	size_t			i, j, len = strlen(literal), nb = 0, n;
+
+	*nbids = 0;
+	if (len < 3)
+		return NULL;
+
+	trigrams = malloc((len - 2) * sizeof(index_trigram_t *));
+	ids = NULL;
+	for (i = 0; i < len; i++) {
+		trigram = ((trigram << 8) | fold(literal[i])) & 0xffffff;
+		if (i < 2)
+			continue;
+		trigrams[nb] = index_lookup(index, trigram);
+		if (!trigrams[nb]) {
+			/* no file at all */
+			free(trigrams);
+			return malloc(sizeof(uint32_t));
+		}
+		nb++;
+	}
+	qsort(trigrams, nb, sizeof(index_trigram_t *), index_trigram_cmp);
+
+	for (i = 0; i < nb; i++) {
+		if (i > 0 && trigrams[i] == trigrams[i - 1])
+			continue;
+
+		/* keep the ids found in this posting list too */
+		p = index->postings + trigrams[i]->offset;
+		id = 0;
+		n = 0;
+		if (!ids)
+			ids = malloc((trigrams[i]->count + 1) * sizeof(uint32_t));
+		for (k = 0, j = 0; k < trigrams[i]->count; k++) {
+			id = k ? id + posting_next(&p) : posting_next(&p);
+			if (i == 0) {
+				ids[n++] = id;
+				continue;
+			}
+			while (j < *nbids && ids[j] < id)
+				j++;
+			if (j < *nbids && ids[j] == id)
+				ids[n++] = ids[j++];
+		}
+		*nbids = n;
+		if (n == 0)
+			break;
+	}
+
+	free(trigrams);
+	return ids;
+}
+
+/* directories modified since they were indexed may hold entries the index
+ * doesn't know about, those are browsed as usual */
+static void index_scan_dir(int worker, const char *root, const char *dir,
+		const manifest_t *manifest, const index_t *segments)
+{
+	char		path[PATH_MAX], rel[PATH_MAX];
+	manifest_slot_t	*slot;
+	ignore_t	*ignore;
+	struct dirent	*ep;
+	DIR		*dp;
+	int		isdir;
+
+	snprintf(path, sizeof(path), "%s/%s", root, dir);
+	dp = opendir(path);
+	if (!dp)
+		return;
+	ignore = ignore_chain(root, dir);
+
+	while ((ep = readdir(dp)) != NULL) {
+		if (is_dir_special(ep->d_name) ||
+		    !strncmp(ep->d_name, INDEX_NAME, strlen(INDEX_NAME)))
+			continue;
+		snprintf(rel, sizeof(rel), "%s%s%s", dir, *dir ? "/" : "",
+			ep->d_name);
+		if (manifest_get(manifest, segments, rel, &slot))
+			continue;
+		isdir = ep->d_type == DT_DIR;
+		if (ignore && is_ignored(ignore, rel, ep->d_name, isdir))
+			continue;
+
+		if (isdir) {
+			if (is_dir_selected(dir, ep->d_name))
+				pool_push(worker, NULL, ignore, root, rel, 1);
+		} else if ((ep->d_type != DT_LNK ||
+			    mainsearch_attr.follow_symlinks) &&
+			   is_file_selected(dir, ep->d_name, dirfd(dp),
+			   ep->d_name)) {
+			pool_push(worker, NULL, ignore, root, rel, 0);
+		}
+	}
+	ignore_release(ignore);
+	closedir(dp);
+}
+
+/* push the files the index deems worth parsing, -1 when the directory has
+ * to be browsed instead. Whether the others and the directories changed
+ * since they were indexed is left to the workers, the search goes on
+ * meanwhile */
+static int index_seed(const char *dir)
+{
+	char			**literals;
+	unsigned char		*selected[INDEX_SEGMENTS];
+	const index_t		*segment;
+	const index_file_t	*file;
+	const char		*rel;
+	unsigned int		nbliterals, s, i, next = 0;
+	uint32_t		*ids, nbids, j;
+	work_t			*work;
+	int			ret = 0;
+
+	/* compressed files are indexed as the binaries they are */
+	if (mainsearch_attr.no_index || mainsearch_attr.has_excludes ||
+	    mainsearch_attr.decompress)
+		return -1;
+
+	/* regexes are narrowed down with the literals they require */
+	if (!mainsearch.is_regex) {
+		literals = mainsearch_attr.patterns;
+		nbliterals = mainsearch_attr.nbpatterns;
+	} else if (mainsearch.matcher.nfa && mainsearch.matcher.prefilter) {
+		literals = mainsearch.matcher.required;
+		nbliterals = mainsearch.matcher.prefilter;
+	} else {
+		return -1;
+	}
+
+	seed.nbsegments = index_open_all(seed.segments, dir);
+	if (seed.nbsegments == 0)
+		return -1;
+
+	for (s = 0; s < seed.nbsegments; s++) {
+		selected[s] = calloc(seed.segments[s].header->nbfiles, 1);
+		for (i = 0; ret == 0 && i < nbliterals; i++) {
+			ids = index_query(&seed.segments[s], literals[i],
+				&nbids);
+			if (!ids) {
+				ret = -1;
+				break;
+			}
+			for (j = 0; j < nbids; j++)
+				selected[s][ids[j]] = 1;
+			free(ids);
+		}
+	}
+
+	seed.root = dir;
+	manifest_init(&seed.manifest, seed.segments, seed.nbsegments);
+	for (s = 0; ret == 0 && s < seed.nbsegments; s++) {
+		segment = &seed.segments[s];
+		for (j = 0; j < segment->header->nbfiles && !is_cancelled();
+		     j++) {
+			if (!manifest_is_live(&seed.manifest, seed.segments,
+			    s, j))
+				continue;
+
+			file = &segment->files[j];
+			rel = segment->paths + file->path;
+			work = work_new(NULL, NULL, dir, rel,
+				(file->flags & INDEX_DIR) != 0);
+			if (work->isdir || (!selected[s][j] &&
+			    !(mainsearch_attr.binary &&
+			    (file->flags & INDEX_BINARY)))) {
+				work->indexed = file;
+			} else if (!is_file_selected(NULL, rel, AT_FDCWD,
+				   work->path)) {
+				free(work);
+				continue;
+			}
+			pool_queue(next++ % pool.nbworkers, work);
+		}
+	}
+
+	for (s = 0; s < seed.nbsegments; s++)
+		free(selected[s]);
+	return ret;
+}
+
+/* an entry the index had no say on: a directory modified since it was
+ * indexed is read again, a file changed since is parsed */
+static void index_check(int worker, batch_t *batch, const work_t *work)
+{
+	const char	*rel = work->path + work->name;
+	struct stat	st;
+
+	if (stat(work->path, &st) < 0 || !manifest_changed(work->indexed, &st))
+		return;
+	if (work->isdir)
+		index_scan_dir(worker, seed.root, rel, &seed.manifest,
+			seed.segments);
+	else if (is_file_selected(NULL, rel, AT_FDCWD, work->path))
+		pool.visit(batch, work);
+}
+
+/* once the workers are done */
+static void index_unseed(void)
+{
+	free(seed.manifest.slots);
+	seed.manifest.slots = NULL;
+	index_close_all(seed.segments, seed.nbsegments);
+	seed.nbsegments = 0;
+}
+
+
+/*************************** NEW SEARCH ***************************************/
+static void matcher_free(matcher_t *matcher)
+{
+	unsigned int i;
+
+	if (matcher->nfa) {
+		free(matcher->nfa->states);
+		free(matcher->nfa);
+	}
+	for (i = 0; i < matcher->prefilter; i++)
+		free(matcher->required[i]);
+	free(matcher->required);
+	for (i = 0; matcher->regex && i < matcher->nbpatterns; i++)
+		regfree(&matcher->regex[i]);
+	free(matcher->regex);
+	free(matcher->ac.delta);
+	free(matcher->ac.out);
+	free(matcher->ac.lens);
+	memset(matcher, 0, sizeof(matcher_t));
+}
+
+static void * garbage_thread(void *arg)
+{
+	garbage_t	*garbage = (garbage_t *) arg;
+	unsigned int	i;
+
+	for (i = 0; i < garbage->nbblocks; i++)
+		free(garbage->blocks[i]);
+	free(garbage->blocks);
+	arena_free(&garbage->arena);
+	free(garbage);
+	return (void *) NULL;
+}
+
+/* pages are keyed by the index of the file entry, which the new search
+ * gives to other files */
+static void page_cache_flush(void)
+{
+	pthread_mutex_t	*mutex;
+	int		i;
+
+	synchronized(page_cache.mutex) {
+		for (i = 0; i < CACHE_PAGES; i++) {
+			page_cache.pages[i].offset = -1;
+			page_cache.pages[i].stamp = 0;
+		}
+	}
+}
+
+/* forget the results of the main search, freeing them in the background
+ * when asked to: no view must be left to read them */
+static void mainsearch_drop(int background)
+{
+	garbage_t	*garbage;
+	pthread_t	thread;
+
+	garbage = malloc(sizeof(garbage_t));
+	garbage->blocks = mainsearch.blocks;
+	garbage->nbblocks = mainsearch.nbblocks;
+	garbage->arena = mainsearch.arena;
+	if (!background || pthread_create(&thread, NULL, &garbage_thread,
+	    garbage))
+		garbage_thread(garbage);
+	else
+		pthread_detach(thread);
+	page_cache_flush();
+
+	mainsearch.blocks = NULL;
+	mainsearch.nbblocks = 0;
+	mainsearch.nbentry = 0;
+	mainsearch.nb_lines = 0;
+	mainsearch.arena.first = NULL;
+	mainsearch.arena.last = NULL;
+	mainsearch.index = 0;
+	mainsearch.cursor = 0;
+}
+
+/* the lookup thread and its workers give up what is left to do, what
+ * they found so far is kept */
+static void mainsearch_stop(void)
+{
+	__atomic_store_n(&pool.cancel, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&pool.idle_mutex);
+	pthread_cond_broadcast(&pool.idle_cond);
+	pthread_mutex_unlock(&pool.idle_mutex);
+	pthread_join(pid, NULL);
+	__atomic_store_n(&pool.cancel, 0, __ATOMIC_SEQ_CST);
+}
+
+/* look for pattern instead, in place of the current search: the views
+ * filtering it are dropped, its workers are stopped and its results are
+ * freed in the background. -1 if pattern is not valid, the current search
+ * going on then */
+static int mainsearch_restart(const char *pattern)
+{
+	pthread_mutex_t	*mutex;
+	matcher_t	matcher;
+	search_t	*father;
+	char		**patterns;
+	unsigned int	i;
+
+	patterns = malloc(sizeof(char *));
+	patterns[0] = strndup(pattern, LINE_MAX - 1);
+	memset(&matcher, 0, sizeof(matcher));
+	if (matcher_init(&matcher, patterns, 1,
+	    strstr(mainsearch.options, "-i") != NULL, mainsearch.is_regex) < 0) {
+		matcher_free(&matcher);
+		free(patterns[0]);
+		free(patterns);
+		return -1;
+	}
+
+	while (current != &mainsearch) {
+		father = current->father;
+		clean_search(current);
+		free(current);
+		current = father;
+	}
+	mainsearch.child = NULL;
+
+	mainsearch_stop();
+	mainsearch_drop(1);
+
+	matcher_free(&mainsearch.matcher);
+	for (i = 0; i < mainsearch_attr.nbpatterns; i++)
+		free(mainsearch_attr.patterns[i]);
+	free(mainsearch_attr.patterns);
+	mainsearch_attr.patterns = patterns;
+	mainsearch_attr.nbpatterns = 1;
+	mainsearch_attr.restarted = 1;
+	mainsearch.matcher = matcher;
+	strcpy(mainsearch.pattern, patterns[0]);
+	mainsearch.status = 1;
+
+	if (pthread_create(&pid, NULL, &lookup_thread, &mainsearch)) {
+		fprintf(stderr, "ngp: cannot create thread");
+		exit(-1);
+	}
+
+	synchronized(mainsearch.data_mutex) {
+		screen_clear();
+		display_entries(&current->index, &current->cursor);
+	}
+	return 0;
+}
+
+
+/*************************** SUBSEARCH ****************************************/
+/* entries are copied a chunk at a time under the lock and matched without
+ * it: the seed first, then the entries of the father; once they are all
+ * scanned, the child waits for the father to grow until it is done as
+ * well, or until it is cancelled */
+static void * subsearch_thread(void *arg)
+{
+	search_t	*child = (search_t *) arg;
+	search_t	*father = child->father;
+	pthread_mutex_t	*mutex;
+	entry_t		*chunk;
+	const char	**paths;
+	uint32_t	*ids, *hits, file = UINT32_MAX;
+	unsigned int	i, n, nbhits;
+	int		done = 0;
+	char		line[PATH_MAX];
+
+	chunk = malloc(SUBSEARCH_CHUNK * sizeof(entry_t));
+	paths = malloc(SUBSEARCH_CHUNK * sizeof(char *));
+	ids = malloc(SUBSEARCH_CHUNK * sizeof(uint32_t));
+	hits = malloc(2 * SUBSEARCH_CHUNK * sizeof(uint32_t));
+
+	while (!done) {
+		n = 0;
+		pthread_mutex_lock(&mainsearch.data_mutex);
+		while (!child->cancel && child->seeded == child->nbseed &&
+		       father->status && child->scanned == father->nbentry)
+			pthread_cond_wait(&father->grown, &mainsearch.data_mutex);
+
+		if (child->cancel) {
+			done = 1;
+		} else if (child->seeded < child->nbseed) {
+			n = child->nbseed - child->seeded;
+			if (n > SUBSEARCH_CHUNK)
+				n = SUBSEARCH_CHUNK;
+			memcpy(ids, child->seed + child->seeded,
+				n * sizeof(uint32_t));
+			child->seeded += n;
+		} else {
+			n = father->nbentry - child->scanned;
+			if (n > SUBSEARCH_CHUNK)
+				n = SUBSEARCH_CHUNK;
+			for (i = 0; i < n; i++)
+				ids[i] = entry_id(father, child->scanned + i);
+			child->scanned += n;
+			done = n == 0 && !father->status;
+		}
+		for (i = 0; i < n; i++) {
+			chunk[i] = *get_entry(&mainsearch, ids[i]);
+			paths[i] = get_entry(&mainsearch, chunk[i].file)->data;
+		}
+		pthread_mutex_unlock(&mainsearch.data_mutex);
+
+		nbhits = 0;
+		for (i = 0; i < n; i++) {
+			if (chunk[i].isfile)
+				continue;
+			entry_text(&chunk[i], paths[i], line, sizeof(line));
+			if (regexec(child->regex, line, 0, NULL, 0))
+				continue;
+			/* the file entry goes along with its first hit */
+			if (chunk[i].file != file) {
+				file = chunk[i].file;
+				hits[nbhits++] = file;
+			}
+			hits[nbhits++] = ids[i];
+		}
+		if (nbhits == 0)
+			continue;
+
+		/* even when cancelled, a replacing filter may narrow these */
+		synchronized(mainsearch.data_mutex) {
+			for (i = 0; i < nbhits; i++)
+				search_add_id(child, hits[i]);
+			pthread_cond_broadcast(&child->grown);
+		}
+		ui_wake();
+	}
+
+	synchronized(mainsearch.data_mutex) {
+		child->status = 0;
+		pthread_cond_broadcast(&child->grown);
+	}
+	ui_wake();
+	free(chunk);
+	free(paths);
+	free(ids);
+	free(hits);
+	return (void *) NULL;
+}
+
+/* stop the subsearch thread, father and child are left as they are */
+static void subsearch_cancel(search_t *child)
+{
+	pthread_mutex_t *mutex;
+
+	if (!child->has_thread)
+		return;
+	synchronized(mainsearch.data_mutex) {
+		child->cancel = 1;
+		pthread_cond_broadcast(&child->father->grown);
+	}
+	pthread_join(child->thread, NULL);
+	child->has_thread = 0;
+}
+
+/* a literal pattern extending an older one only matches lines the older
+ * one matched */
+static int is_narrowing(const char *old, const char *pattern)
+{
+	return !strncmp(old, pattern, strlen(old)) &&
+		!strpbrk(pattern, ".[]*^$\\");
+}
+
+/* the child view is filled in the background, from what the father holds
+ * and from whatever it finds later on. The filter of old, which the child
+ * replaces, is stopped: when pattern narrows it, what it kept is scanned
+ * instead of the entries of the father it went through */
+static search_t * subsearch_start(search_t *father, const char *pattern,
+		search_t *old)
+{
+	search_t	*child;
+	unsigned int	left;
+
+	/* create and init subsearch */
+	if ((child = malloc(sizeof(search_t))) == NULL)
+		exit(1);
+
+	init_searchstruct(child);
+	child->father = father;
+	strncpy(child->pattern, pattern, LINE_MAX - 1);
+	child->pattern[LINE_MAX - 1] = '\0';
+
+	if (!is_regex_valid(child)) {
+		clean_search(child);
+		free(child);
+		return NULL;
+	}
+
+	if (old)
+		subsearch_cancel(old);
+	if (old && is_narrowing(old->pattern, child->pattern)) {
+		left = old->nbseed - old->seeded;
+		child->nbseed = old->nbentry + left;
+		child->seed = malloc((child->nbseed + 1) * sizeof(uint32_t));
+		memcpy(child->seed, old->ids, old->nbentry * sizeof(uint32_t));
+		memcpy(child->seed + old->nbentry, old->seed + old->seeded,
+			left * sizeof(uint32_t));
+		child->scanned = old->scanned;
+	}
+
+	if (pthread_create(&child->thread, NULL, &subsearch_thread, child))
+		subsearch_thread(child);
+	else
+		child->has_thread = 1;
+
+	return child;
+}
+
+static void prompt_open(int new_search)
+{
+	prompt.win = newwin(3, 50, (LINES - 3) / 2, (COLS - 50) / 2);
+	prompt.new_search = new_search;
+	prompt.father = current;
+	prompt.text[0] = '\0';
+	prompt.len = 0;
+	prompt.deadline = 0;
+	prompt.error = NULL;
+}
+
+/* drawn over the results, after them */
+static void prompt_draw(void)
+{
+	const char	*label = prompt.new_search ? "New search: " : "To search: ";
+	int		room = 48 - strlen(label);
+	int		skip = prompt.len > room ? prompt.len - room : 0;
+
+	werase(prompt.win);
+	box(prompt.win, 0, 0);
+	mvwprintw(prompt.win, 1, 1, "%s%s", label, prompt.text + skip);
+	if (prompt.error)
+		mvwprintw(prompt.win, 2, 2, " %s ", prompt.error);
+	touchwin(prompt.win);
+	wrefresh(prompt.win);
+}
+
+/* filter the father with what has been typed so far, the former child
+ * view is replaced; nothing changes while the pattern is not a valid
+ * regex */
+static void prompt_apply(void)
+{
+	pthread_mutex_t	*mutex;
+	search_t	*old, *child = NULL;
+
+	prompt.deadline = 0;
+	old = current != prompt.father ? current : NULL;
+	if (prompt.len > 0) {
+		child = subsearch_start(prompt.father, prompt.text, old);
+		if (!child)
+			return;
+	}
+
+	if (old) {
+		clean_search(old);
+		free(old);
+	}
+	prompt.father->child = child;
+	current = child ? child : prompt.father;
+	synchronized(mainsearch.data_mutex) {
+		screen_clear();
+		display_entries(&current->index, &current->cursor);
+	}
+}
+
+static void prompt_close(void)
+{
+	pthread_mutex_t *mutex;
+
+	delwin(prompt.win);
+	prompt.win = NULL;
+	synchronized(mainsearch.data_mutex) {
+		screen_clear();
+		display_entries(&current->index, &current->cursor);
+	}
+}
+
+/* the filter is applied once typing pauses for DEBOUNCE_MS, right away
+ * with enter; escape goes back to the father. A new search only starts
+ * with enter, the prompt stays open on a pattern that is not valid */
+static void prompt_key(int ch)
+{
+	prompt.error = NULL;
+	switch (ch) {
+	case '\n':
+		if (prompt.new_search && prompt.len > 0 &&
+		    mainsearch_restart(prompt.text) < 0) {
+			prompt.error = "invalid pattern";
+			break;
+		}
+		if (!prompt.new_search && prompt.deadline)
+			prompt_apply();
+		prompt_close();
+		break;
+	case 27:
+		prompt.text[0] = '\0';
+		prompt.len = 0;
+		if (!prompt.new_search)
+			prompt_apply();
+		prompt_close();
+		break;
+	case 8:
+	case 127:
+	case KEY_BACKSPACE:
+		if (prompt.len > 0)
+			prompt.text[--prompt.len] = '\0';
+		if (!prompt.new_search)
+			prompt.deadline = now_ms() + DEBOUNCE_MS;
+		break;
+	default:
+		if (ch < ' ' || ch > UCHAR_MAX || prompt.len >= LINE_MAX - 1)
+			break;
+		prompt.text[prompt.len++] = ch;
+		prompt.text[prompt.len] = '\0';
+		if (!prompt.new_search)
+			prompt.deadline = now_ms() + DEBOUNCE_MS;
+		break;
+	}
+}
+
+
+/*************************** CLEANUP ******************************************/
+static void clean_search(search_t *search)
+{
+	unsigned int i;
+
+	subsearch_cancel(search);
+	pthread_cond_destroy(&search->grown);
+	for (i = 0; i < search->nbblocks; i++)
+		free(search->blocks[i]);
+	free(search->blocks);
+	free(search->ids);
+	free(search->seed);
+	arena_free(&search->arena);
+	free(search->regex);
+//	free(search); //wont work cuz mainsearch ain't no pointer yo
+}
+
+static void clean_all(void)
+{
+	search_t	*next;
+	exclude_list_t	*curex, *tmpex;
+	unsigned int	i;
+
+	/* free linked list of excludes, and the file selection */
+	curex = mainsearch_attr.firstexcl;
+	while (curex) {
+		tmpex = curex;
+		curex = curex->next;
+		free(tmpex);
+	}
+
+	selector_free();
+
+	for (i = 0; i < mainsearch_attr.nbpatterns; i++)
+		free(mainsearch_attr.patterns[i]);
+	free(mainsearch_attr.patterns);
+
+	for (i = 0; i < CACHE_PAGES; i++)
+		free(page_cache.pages[i].data);
+	free(screen.rows);
+	filelist_free();
+
+	for (i = 0; i < 2; i++) {
+		if (ui_pipe[i] >= 0)
+			close(ui_pipe[i]);
+		ui_pipe[i] = -1;
+	}
+
+	next = current->father;
+	while (next) {
+		next = current->father;
+		clean_search(current);
+		current = next;
+	}
+}
+
+static void ncurses_stop()
+{
+	endwin();
+}
+
+/* the main loop is told to leave, curses can't be stopped from here */
+static void sig_handler(int signo)
+{
+	if (signo == SIGINT) {
+		interrupted = 1;
+		ui_wake();
+	}
+}
+
+/* -1 when ngp is to be left */
+static int handle_key(int ch, const char *editor)
+{
+	pthread_mutex_t	*mutex;
+	search_t	*tmp;
+
+	if (prompt.win && ch != KEY_RESIZE) {
+		prompt_key(ch);
+		return 0;
+	}
+
+	switch(ch) {
+	case KEY_RESIZE:
+		synchronized(mainsearch.data_mutex)
+			resize(&current->index, &current->cursor);
+		break;
+	case CURSOR_DOWN:
+	case KEY_DOWN:
+		synchronized(mainsearch.data_mutex)
+			cursor_down(&current->index, &current->cursor);
+		break;
+	case CURSOR_UP:
+	case KEY_UP:
+		synchronized(mainsearch.data_mutex)
+			cursor_up(&current->index, &current->cursor);
+		break;
+	case KEY_PPAGE:
+	case PAGE_UP:
+		synchronized(mainsearch.data_mutex)
+			page_up(&current->index, &current->cursor);
+		break;
+	case KEY_NPAGE:
+	case PAGE_DOWN:
+		synchronized(mainsearch.data_mutex)
+			page_down(&current->index, &current->cursor);
+		break;
+	case '/':
+		prompt_open(0);
+		break;
+	case NEW_SEARCH:
+		prompt_open(1);
+		break;
+#ifdef NGP_STATS
+	case STATS_PANEL:
+		stats_toggle();
+		break;
+#endif
+	case ENTER:
+	case '\n':
+		ncurses_stop();
+		open_entry(current->cursor + current->index, editor,
+			current->pattern);
+		ncurses_init();
+		resize(&current->index, &current->cursor);
+		break;
+	case QUIT:
+		if (current->father == NULL)
+			return -1;
+		tmp = current->father;
+		clean_search(current);
+		current = tmp;
+		current->child = NULL;
+		synchronized(mainsearch.data_mutex) {
+			screen_clear();
+			display_entries(&current->index, &current->cursor);
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int ch;
 	int first = 0;
 	const char *editor = NULL;
 	pthread_mutex_t *mutex;
-	search_t *tmp;
-	specific_files_t	*curspec = NULL;
-	extension_list_t	*curext = NULL;
 	exclude_list_t		*curexcl= NULL;
+	struct pollfd		fds[2];
+	char			drain[64];
+	long			now, last_frame = 0, timeout, delay;
+	int			dirty = 0, keyed, done, running = 0;
+	size_t			len;
+	search_t		*search;
 
 	current = &mainsearch;
 	init_searchstruct(&mainsearch);
 	pthread_mutex_init(&mainsearch.data_mutex, NULL);
-	editor = get_config(editor, &curext, &curspec);
-	get_args(argc, argv, &curext, &curexcl);
-
-	if (argc - optind < 1 || argc - optind > 2) {
+	pthread_mutex_init(&page_cache.mutex, NULL);
+	pthread_mutex_init(&filelist.mutex, NULL);
+	pthread_mutex_init(&output_mutex, NULL);
+	selector.max_size = -1;
+	editor = get_config(editor);
+	get_args(argc, argv, &curexcl);
+
+	/* patterns given with -p leave room for the directory only, so does
+	 * building an index */
+	if (mainsearch_attr.nbpatterns > 0 || mainsearch_attr.index_action)
+		first = 1;
+
+	if (argc - optind < 1 - first || argc - optind > 2 - first) {
 		usage();
 	}
 
 	for ( ; optind < argc; optind++) {
 		if (!first) {
-			strcpy(mainsearch.pattern, argv[optind]);
+			add_pattern(argv[optind]);
 			first = 1;
 		} else {
 			strcpy(mainsearch.directory, argv[optind]);
 		}
 	}
 
-	if (mainsearch.is_regex && !is_regex_valid(&mainsearch)) {
+	/* paths of the files found are made from it */
+	len = strlen(mainsearch.directory);
+	while (len > 1 && mainsearch.directory[len - 1] == '/')
+		mainsearch.directory[--len] = '\0';
+
+	if (mainsearch_attr.index_action) {
+		if (mainsearch_attr.index_action == INDEX_BUILD)
+			index_build(mainsearch.directory);
+		else if (mainsearch_attr.index_action == INDEX_UPDATE)
+			index_update(mainsearch.directory);
+		else
+			index_watch(mainsearch.directory);
+		clean_all();
+		return 0;
+	}
+	strcpy(mainsearch.pattern, mainsearch_attr.patterns[0]);
+
+	if (matcher_init(&mainsearch.matcher, mainsearch_attr.patterns,
+	    mainsearch_attr.nbpatterns, strstr(mainsearch.options, "-i") != NULL,
+	    mainsearch.is_regex) < 0) {
 		fprintf(stderr, "Bad regexp\n");
 		goto quit;
 	}
 
+	/* hits are streamed out as the workers find them, status tells
+	 * whether there were any, as with grep */
+	if (mainsearch_attr.output) {
+		lookup_thread(&mainsearch);
+#ifdef NGP_STATS
+		if (stats_report)
+			stats_dump();
+#endif
+		clean_all();
+		return mainsearch.nb_lines ? 0 : 1;
+	}
+	ui_pipe_init();
 	signal(SIGINT, sig_handler);
 
-	mainsearch.entries = (entry_t *) calloc(mainsearch.size, sizeof(entry_t));
-
 	if (pthread_create(&pid, NULL, &lookup_thread, &mainsearch)) {
 		fprintf(stderr, "ngp: cannot create thread");
 		clean_search(&mainsearch);
 		exit(-1);
 	}
+	running = 1;
 
 	ncurses_init();
 
 	synchronized(mainsearch.data_mutex)
 		display_entries(&mainsearch.index, &mainsearch.cursor);
 
-	while ((ch = getch())) {
-		switch(ch) {
-		case KEY_RESIZE:
-			synchronized(mainsearch.data_mutex)
-				resize(&current->index, &current->cursor);
-			break;
-		case CURSOR_DOWN:
-		case KEY_DOWN:
-			synchronized(mainsearch.data_mutex)
-				cursor_down(&current->index, &current->cursor);
-			break;
-		case CURSOR_UP:
-		case KEY_UP:
-			synchronized(mainsearch.data_mutex)
-				cursor_up(&current->index, &current->cursor);
-			break;
-		case KEY_PPAGE:
-		case PAGE_UP:
-			synchronized(mainsearch.data_mutex)
-				page_up(&current->index, &current->cursor);
-			break;
-		case KEY_NPAGE:
-		case PAGE_DOWN:
-			synchronized(mainsearch.data_mutex)
-				page_down(&current->index, &current->cursor);
-			break;
-		case '/':
-			tmp = subsearch(current);
-			clear();
-			if (tmp != NULL)
-				current = tmp;
-			display_entries(&current->index, &current->cursor);
-			break;
-		case ENTER:
-		case '\n':
-			ncurses_stop();
-			open_entry(current->cursor + current->index, editor,
-				current->pattern);
-			ncurses_init();
-			resize(&current->index, &current->cursor);
-			break;
-		case QUIT:
-			if (current->father == NULL) {
-				goto quit;
-			} else {
-				tmp = current->father;
-				clean_search(current);
-				current = tmp;
-				current->child = NULL;
-				clear();
-				display_entries(&current->index, &current->cursor);
-			}
-		default:
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = ui_pipe[0];
+	fds[1].events = POLLIN;
+	while (!interrupted) {
+		/* keys are handled as soon as they come, new hits are shown
+		 * a frame at a time and the spinner turns while searching;
+		 * past that there is nothing to wake up for */
+		timeout = -1;
+		if (dirty || current->status) {
+			timeout = last_frame + (dirty ? FRAME_MS : SPINNER_MS)
+				- now_ms();
+			if (timeout < 0)
+				timeout = 0;
+		}
+		if (prompt.deadline) {
+			delay = prompt.deadline - now_ms();
+			if (delay < 0)
+				delay = 0;
+			if (timeout < 0 || delay < timeout)
+				timeout = delay;
+		}
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR)
 			break;
+
+		if (fds[1].revents & POLLIN) {
+			while (read(ui_pipe[0], drain, sizeof(drain)) > 0)
+				;
+			dirty = 1;
 		}
 
-		usleep(10000);
-		refresh();
-		synchronized(mainsearch.data_mutex) {
-			display_status();
+		keyed = 0;
+		while ((ch = getch()) != ERR) {
+			if (handle_key(ch, editor) < 0)
+				goto quit;
+			keyed = 1;
+		}
+		if (prompt.deadline && now_ms() >= prompt.deadline) {
+			prompt_apply();
+			keyed = 1;
 		}
 
+		now = now_ms();
+		if (!keyed && now - last_frame < (dirty ? FRAME_MS : SPINNER_MS))
+			continue;
+		STAT_START(frame);
 		synchronized(mainsearch.data_mutex) {
-			if (mainsearch.status == 0 && mainsearch.nbentry == 0) {
-				goto quit;
-			}
+			display_entries(&current->index, &current->cursor);
+			display_status();
+			done = mainsearch.status == 0 &&
+				mainsearch.nbentry == 0 &&
+				!mainsearch_attr.restarted;
 		}
+		refresh();
+		if (prompt.win)
+			prompt_draw();
+#ifdef NGP_STATS
+		stats_draw();
+#endif
+		STAT_TIME(render_ns, frame);
+		STAT_ADD(frames, 1);
+		if (done)
+			goto quit;
+		last_frame = now;
+		dirty = 0;
 	}
 
 quit:
 	ncurses_stop();
+	/* nothing may still be reading what is about to be freed */
+	if (running) {
+		for (search = current; search; search = search->father)
+			subsearch_cancel(search);
+		mainsearch_stop();
+	}
+#ifdef NGP_STATS
+	if (stats_report)
+		stats_dump();
+#endif
 	clean_all();
-	return 0;
+	return interrupted ? -1 : 0;
 }
 